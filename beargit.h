@@ -2,18 +2,46 @@
 
 int beargit_init(void);
 int beargit_add(const char* filename);
+int beargit_add_tree(const char* dirname);
 int beargit_rm(const char* filename);
 int beargit_commit(const char* message);
 int beargit_status();
+int beargit_status_untracked();
 int beargit_log(int limit);
+int beargit_log_rev(const char* rev, int limit);
+int beargit_log_grep(const char* pattern, int limit);
+int beargit_log_paths(const char** paths, int num_paths, int limit);
+int beargit_blame(const char* filename, const char* rev);
 int beargit_branch();
+int beargit_branch_delete(const char* branch_name);
 int beargit_checkout(const char* arg, int new_branch);
 int beargit_reset(const char* commit_id, const char* filename);
+int beargit_reset_paths(const char* commit_id, const char** filenames, int num_files);
 int beargit_merge(const char* arg);
+int beargit_fsmonitor(const char* action);
+int beargit_gc(const char* grace);
+int beargit_rev_list(const char** revs, int num_revs, int count_only);
+int beargit_is_ancestor(const char* ancestor, const char* descendant);
+int beargit_clone(const char* path, const char* directory);
+int beargit_fetch(const char* path);
+int beargit_push(const char* path, const char* branch);
+int beargit_bundle(const char* action, const char* filename, const char** revs, int num_revs);
+int beargit_sparse(const char* action, const char** patterns, int num_patterns);
+int beargit_archive(const char* rev, const char* format, const char* output);
+int beargit_fast_import(const char* filename);
+int beargit_fast_export(const char* output);
+int beargit_migrate_objects();
+int beargit_show(const char* rev);
+int beargit_stash(const char* action);
 
 // Helper functions
 int get_branch_number(const char* branch_name);
 void next_commit_id(char* commit_id);
+int at_first_commit(const char* commit_id);
+int resolve_rev(const char* rev, char* commit_id);
+int expand_commit_id(const char* prefix, char* commit_id);
+void commit_path(char* path, const char* commit_id, const char* name);
+void object_layout_reset(void);
 
 // Number of bytes in a commit id
 #define COMMIT_ID_BYTES SHA_HEX_BYTES
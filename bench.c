@@ -0,0 +1,399 @@
+/**
+ * Microbenchmarks for the primitives that every beargit command is built on.
+ *
+ * Usage: beargit-bench [-n <reps>] [--json <out>] [--baseline <in>]
+ *                      [--threshold <pct>] [--filter <substr>]
+ *
+ * Every case is run in a scratch directory (a fresh repository is created with
+ * beargit_init), warmed up, and then sampled <reps> times. For each case we
+ * report latency percentiles and, for sized cases, throughput based on the
+ * median. Cases touching files are run twice: once with a warm page cache and
+ * once after asking the kernel to drop the source file from the page cache
+ * (posix_fadvise(POSIX_FADV_DONTNEED), which works without root).
+ *
+ * --json writes the results as one JSON object per case, --baseline reads such
+ * a file back and prints the change of the median per case. The exit status is
+ * 1 if any case got slower than --threshold percent (default 10); a missing
+ * baseline file is only noted.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "util.h"
+
+#define BENCH_DEFAULT_REPS 200
+#define BENCH_WARMUP 5
+#define BENCH_MAX_CASES 128
+#define BENCH_NAME_SIZE 96
+
+enum cache_state { CACHE_NONE, CACHE_WARM, CACHE_COLD };
+
+struct bench_result {
+  char name[BENCH_NAME_SIZE];
+  long size;
+  enum cache_state cache;
+  double min_ns;
+  double p50_ns;
+  double p90_ns;
+  double p99_ns;
+  double mean_ns;
+  double stddev_ns;
+  double mb_per_s;
+};
+
+static struct bench_result results[BENCH_MAX_CASES];
+static int num_results = 0;
+static int reps = BENCH_DEFAULT_REPS;
+static const char* filter = NULL;
+
+static const char* cache_names[] = { "-", "warm", "cold" };
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int n, double p) {
+  double rank = p * (n - 1);
+  int lo = (int) rank;
+  int hi = lo + 1 < n ? lo + 1 : lo;
+  return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+}
+
+// Drops <filename> from the page cache so the next read has to hit the disk.
+static void drop_from_cache(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void write_file_of_size(const char* filename, long size) {
+  FILE* fout = fopen(filename, "w");
+  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't create benchmark input");
+  unsigned int seed = 12345;
+  for (long i = 0; i < size; i++) {
+    seed = seed * 1103515245 + 12345;
+    fputc('a' + (seed >> 16) % 26, fout);
+  }
+  fclose(fout);
+}
+
+/* A benchmark case: <setup> runs untimed before every sample, <run> is the
+ * timed part. <arg> is passed to both. */
+typedef void (*bench_fn)(void* arg);
+
+static void record(const char* name, long size, enum cache_state cache,
+                   double* samples, int n) {
+  qsort(samples, n, sizeof(double), compare_doubles);
+
+  struct bench_result* r = &results[num_results++];
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  r->size = size;
+  r->cache = cache;
+  r->min_ns = samples[0];
+  r->p50_ns = percentile(samples, n, 0.50);
+  r->p90_ns = percentile(samples, n, 0.90);
+  r->p99_ns = percentile(samples, n, 0.99);
+
+  double sum = 0, sq = 0;
+  for (int i = 0; i < n; i++)
+    sum += samples[i];
+  r->mean_ns = sum / n;
+  for (int i = 0; i < n; i++)
+    sq += (samples[i] - r->mean_ns) * (samples[i] - r->mean_ns);
+  r->stddev_ns = sqrt(sq / n);
+  r->mb_per_s = size > 0 ? (size / 1e6) / (r->p50_ns / 1e9) : 0;
+
+  printf("%-32s %9ld %-5s %11.0f %11.0f %11.0f %11.0f %7.1f%% %10.1f\n",
+         r->name, r->size, cache_names[r->cache], r->min_ns, r->p50_ns,
+         r->p90_ns, r->p99_ns, 100.0 * r->stddev_ns / r->mean_ns, r->mb_per_s);
+}
+
+static void run_case(const char* name, long size, enum cache_state cache,
+                     bench_fn setup, bench_fn run, void* arg) {
+  if (filter && !strstr(name, filter))
+    return;
+  if (num_results == BENCH_MAX_CASES)
+    return;
+
+  double* samples = malloc(sizeof(double) * reps);
+  for (int i = 0; i < BENCH_WARMUP + reps; i++) {
+    if (setup)
+      setup(arg);
+    double start = now_ns();
+    run(arg);
+    double elapsed = now_ns() - start;
+    if (i >= BENCH_WARMUP)
+      samples[i - BENCH_WARMUP] = elapsed;
+  }
+  record(name, size, cache, samples, reps);
+  free(samples);
+}
+
+/* fs_cp */
+
+static void cp_setup_cold(void* arg) {
+  drop_from_cache("bench_src");
+}
+
+static void cp_run(void* arg) {
+  fs_cp("bench_src", "bench_dst");
+}
+
+/* cryptohash */
+
+static void hash_run(void* arg) {
+  char hash[SHA_HEX_BYTES + 1];
+  cryptohash((const char*) arg, hash);
+}
+
+/* write_string_to_file / read_string_from_file */
+
+struct string_arg {
+  char* str;
+  int size;
+};
+
+static void write_string_run(void* arg) {
+  write_string_to_file("bench_str", ((struct string_arg*) arg)->str);
+}
+
+static void read_string_setup_cold(void* arg) {
+  drop_from_cache("bench_str");
+}
+
+static void read_string_run(void* arg) {
+  struct string_arg* s = arg;
+  read_string_from_file("bench_str", s->str, s->size);
+}
+
+/* Index scanning in beargit_add: adding one more file to an index that
+ * already tracks <n> files. The file is removed again (untimed) in setup. */
+
+static void add_setup(void* arg) {
+  FILE* findex = fopen(".beargit/.index", "r");
+  char line[FILENAME_SIZE];
+  int found = 0;
+  while (fgets(line, sizeof(line), findex)) {
+    strtok(line, "\n");
+    if (strcmp(line, "bench_new") == 0)
+      found = 1;
+  }
+  fclose(findex);
+  if (found)
+    beargit_rm("bench_new");
+}
+
+static void add_run(void* arg) {
+  beargit_add("bench_new");
+}
+
+/* get_branch_number: looking up the last of <n> branches. */
+
+static void branch_run(void* arg) {
+  get_branch_number((const char*) arg);
+}
+
+static void fill_index(int n) {
+  FILE* findex = fopen(".beargit/.index", "w");
+  for (int i = 0; i < n; i++)
+    fprintf(findex, "tracked_file_%06d.txt\n", i);
+  fclose(findex);
+}
+
+static void fill_branches(int n, char* last) {
+  FILE* fbranches = fopen(".beargit/.branches", "w");
+  fprintf(fbranches, "master\n");
+  for (int i = 1; i < n; i++) {
+    sprintf(last, "branch_%06d", i);
+    fprintf(fbranches, "%s\n", last);
+  }
+  fclose(fbranches);
+}
+
+static void run_all(void) {
+  static const long copy_sizes[] = { 1 << 10, 64 << 10, 1 << 20, 16 << 20 };
+  static const long hash_sizes[] = { 64, 4 << 10, 64 << 10 };
+  static const long string_sizes[] = { 64, 4 << 10, 64 << 10 };
+  static const int index_sizes[] = { 100, 1000, 10000 };
+  static const int branch_counts[] = { 10, 100, 1000 };
+
+  for (int i = 0; i < sizeof(copy_sizes) / sizeof(long); i++) {
+    write_file_of_size("bench_src", copy_sizes[i]);
+    run_case("fs_cp", copy_sizes[i], CACHE_WARM, NULL, cp_run, NULL);
+    run_case("fs_cp", copy_sizes[i], CACHE_COLD, cp_setup_cold, cp_run, NULL);
+  }
+
+  for (int i = 0; i < sizeof(hash_sizes) / sizeof(long); i++) {
+    char* str = malloc(hash_sizes[i] + 1);
+    memset(str, 'x', hash_sizes[i]);
+    str[hash_sizes[i]] = '\0';
+    run_case("cryptohash", hash_sizes[i], CACHE_NONE, NULL, hash_run, str);
+    free(str);
+  }
+
+  for (int i = 0; i < sizeof(string_sizes) / sizeof(long); i++) {
+    struct string_arg s;
+    s.size = string_sizes[i];
+    s.str = malloc(s.size);
+    memset(s.str, 'y', s.size - 1);
+    s.str[s.size - 1] = '\0';
+    run_case("write_string_to_file", s.size, CACHE_NONE, NULL, write_string_run, &s);
+    run_case("read_string_from_file", s.size, CACHE_WARM, NULL, read_string_run, &s);
+    run_case("read_string_from_file", s.size, CACHE_COLD, read_string_setup_cold,
+             read_string_run, &s);
+    free(s.str);
+  }
+
+  write_string_to_file("bench_new", "");
+  for (int i = 0; i < sizeof(index_sizes) / sizeof(int); i++) {
+    char name[BENCH_NAME_SIZE];
+    sprintf(name, "beargit_add/index=%d", index_sizes[i]);
+    fill_index(index_sizes[i]);
+    run_case(name, 0, CACHE_WARM, add_setup, add_run, NULL);
+  }
+
+  for (int i = 0; i < sizeof(branch_counts) / sizeof(int); i++) {
+    char name[BENCH_NAME_SIZE];
+    char last[BRANCHNAME_SIZE];
+    sprintf(name, "get_branch_number/branches=%d", branch_counts[i]);
+    fill_branches(branch_counts[i], last);
+    run_case(name, 0, CACHE_WARM, NULL, branch_run, last);
+  }
+}
+
+static void write_json(const char* filename) {
+  FILE* fout = fopen(filename, "w");
+  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't open JSON output file");
+  fprintf(fout, "[\n");
+  for (int i = 0; i < num_results; i++) {
+    struct bench_result* r = &results[i];
+    fprintf(fout, "{\"name\": \"%s\", \"size\": %ld, \"cache\": \"%s\", "
+            "\"min_ns\": %.0f, \"p50_ns\": %.0f, \"p90_ns\": %.0f, \"p99_ns\": %.0f, "
+            "\"mean_ns\": %.0f, \"stddev_ns\": %.0f, \"mb_per_s\": %.2f}%s\n",
+            r->name, r->size, cache_names[r->cache], r->min_ns, r->p50_ns,
+            r->p90_ns, r->p99_ns, r->mean_ns, r->stddev_ns, r->mb_per_s,
+            i + 1 < num_results ? "," : "");
+  }
+  fprintf(fout, "]\n");
+  fclose(fout);
+}
+
+/* Reads a file written by write_json and compares the medians. Returns the
+ * number of cases that got slower than <threshold> percent. */
+static int compare_baseline(const char* filename, double threshold) {
+  FILE* fin = fopen(filename, "r");
+  if (fin == NULL) {
+    // The first run on a new machine or branch has nothing to compare to.
+    printf("\nNo baseline at %s; nothing to compare.\n", filename);
+    return 0;
+  }
+
+  printf("\n%-32s %9s %-5s %11s %11s %8s\n", "case", "size", "cache",
+         "base p50", "p50", "change");
+
+  int regressions = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), fin)) {
+    char name[BENCH_NAME_SIZE], cache[8];
+    long size;
+    double p50;
+    if (sscanf(line, "{\"name\": \"%95[^\"]\", \"size\": %ld, \"cache\": \"%7[^\"]\", "
+               "\"min_ns\": %*f, \"p50_ns\": %lf", name, &size, cache, &p50) != 4)
+      continue;
+
+    for (int i = 0; i < num_results; i++) {
+      struct bench_result* r = &results[i];
+      if (strcmp(r->name, name) != 0 || r->size != size
+          || strcmp(cache_names[r->cache], cache) != 0)
+        continue;
+
+      double change = 100.0 * (r->p50_ns - p50) / p50;
+      int slower = change > threshold;
+      regressions += slower;
+      printf("%-32s %9ld %-5s %11.0f %11.0f %+7.1f%%%s\n", name, size, cache,
+             p50, r->p50_ns, change, slower ? "  REGRESSION" : "");
+    }
+  }
+  fclose(fin);
+  return regressions;
+}
+
+int main(int argc, char** argv) {
+  const char* json_file = NULL;
+  const char* baseline_file = NULL;
+  double threshold = 10.0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json_file = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline_file = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    } else {
+      fprintf(stderr, "Usage: %s [-n <reps>] [--json <out>] [--baseline <in>] "
+              "[--threshold <pct>] [--filter <substr>]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (reps < 1) {
+    fprintf(stderr, "ERROR:  Need at least one repetition.\n");
+    return 2;
+  }
+
+  // Resolve output paths before moving into the scratch directory.
+  char cwd[PATH_MAX];
+  ASSERT_ERROR_MESSAGE(getcwd(cwd, sizeof(cwd)) != NULL, "couldn't get working directory");
+  char json_path[PATH_MAX + FILENAME_SIZE], baseline_path[PATH_MAX + FILENAME_SIZE];
+  if (json_file)
+    snprintf(json_path, sizeof(json_path), "%s%s%s", json_file[0] == '/' ? "" : cwd,
+             json_file[0] == '/' ? "" : "/", json_file);
+  if (baseline_file)
+    snprintf(baseline_path, sizeof(baseline_path), "%s%s%s", baseline_file[0] == '/' ? "" : cwd,
+             baseline_file[0] == '/' ? "" : "/", baseline_file);
+
+  char scratch[] = "/tmp/beargit-bench-XXXXXX";
+  ASSERT_ERROR_MESSAGE(mkdtemp(scratch) != NULL, "couldn't create scratch directory");
+  ASSERT_ERROR_MESSAGE(chdir(scratch) == 0, "couldn't enter scratch directory");
+  beargit_init();
+
+  printf("%-32s %9s %-5s %11s %11s %11s %11s %8s %10s\n", "case", "size", "cache",
+         "min ns", "p50 ns", "p90 ns", "p99 ns", "cv", "MB/s");
+  run_all();
+
+  ASSERT_ERROR_MESSAGE(chdir(cwd) == 0, "couldn't leave scratch directory");
+  char cleanup[sizeof(scratch) + 16];
+  sprintf(cleanup, "rm -rf %s", scratch);
+  system(cleanup);
+
+  if (json_file)
+    write_json(json_path);
+  if (baseline_file)
+    return compare_baseline(baseline_path, threshold) > 0;
+  return 0;
+}
@@ -1,3 +1,5 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -21,11 +23,19 @@ int init_suite(void)
 {
     // preps to run tests by deleting the .beargit directory if it exists
     fs_force_rm_beargit_dir();
-    unlink("TEST_STDOUT");
-    unlink("TEST_STDERR");
+    capture_clear(stdout);
+    capture_clear(stderr);
     return 0;
 }
 
+/* The per-test setup of the suites that hold several tests, which would
+ * otherwise see what the test before them left behind.
+ */
+void init_test(void)
+{
+    init_suite();
+}
+
 /* You can also delete leftover files after a test suite runs, but there's
  * no need to duplicate code between this and init_suite 
  */
@@ -44,10 +54,10 @@ void simple_sample_test(void)
     // This is a very basic test. Your tests should likely do more than this.
     // We suggest checking the outputs of printfs/fprintfs to both stdout
     // and stderr. To make this convenient for you, the tester replaces
-    // printf and fprintf with copies that write data to a file for you
-    // to access. To access all output written to stdout, you can read 
-    // from the "TEST_STDOUT" file. To access all output written to stderr,
-    // you can read from the "TEST_STDERR" file.
+    // printf and fprintf with copies that capture the data in memory for
+    // you to access. capture_get(stdout) returns all output written to
+    // stdout, capture_open(stderr) opens everything written to stderr for
+    // reading, and capture_clear(stdout) starts over.
     int retval;
     retval = beargit_init();
     CU_ASSERT(0==retval);
@@ -104,7 +114,7 @@ void simple_log_test(void)
     const int LINE_SIZE = 512;
     char line[LINE_SIZE];
 
-    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    FILE* fstdout = capture_open(stdout);
     CU_ASSERT_PTR_NOT_NULL(fstdout);
 
     while (cur_commit != NULL) {
@@ -148,12 +158,12 @@ void test_commit_1(void)
   const int LINE_SIZE = 512;
   char line[LINE_SIZE];
 
-  stderr = fopen("TEST_STDERR", "r");
-  CU_ASSERT_PTR_NOT_NULL(stderr);
+  FILE* fstderr = capture_open(stderr);
+  CU_ASSERT_PTR_NOT_NULL(fstderr);
 
-  CU_ASSERT_PTR_NOT_NULL(fgets(line, LINE_SIZE, stderr));
+  CU_ASSERT_PTR_NOT_NULL(fgets(line, LINE_SIZE, fstderr));
   CU_ASSERT_STRING_EQUAL(line, "ERROR:  Message must contain \"THIS IS BEAR TERRITORY!\"\n");
-  fclose(stderr);
+  fclose(fstderr);
 }
 void test_commit_2(void)
 {
@@ -192,7 +202,7 @@ void test_commit_messages(void)
   retval = beargit_commit("THIS IS BEAR TERRITORY 1234 THIS IS BEAR TERRITORY! THIS IS NOT BEAR TERRITORY!");
   CU_ASSERT(0 == retval);
 
-  FILE* fstderr = fopen("TEST_STDERR", "r");
+  FILE* fstderr = capture_open(stderr);
   char line[512];
   CU_ASSERT_PTR_NOT_NULL(fstderr);
   CU_ASSERT_PTR_NOT_NULL(fgets(line, 512, fstderr));
@@ -216,7 +226,7 @@ void test_not_at_head(void)
   retval = beargit_commit("THIS IS BEAR TERRITORY!");
   CU_ASSERT(0 != retval);
   char line[512];
-  FILE* fstderr = fopen("TEST_STDERR", "r");
+  FILE* fstderr = capture_open(stderr);
   CU_ASSERT_PTR_NOT_NULL(fstderr);
   CU_ASSERT_PTR_NOT_NULL(fgets(line, 512, fstderr));
   CU_ASSERT_STRING_EQUAL(line, "ERROR:  Need to be on HEAD of a branch to commit.\n");
@@ -333,7 +343,7 @@ void test_checkout_input(void)
   CU_ASSERT(0 != retval);
 
   //error messages
-  FILE* fstderr = fopen("TEST_STDERR", "r");
+  FILE* fstderr = capture_open(stderr);
   char line[512];
   fgets(line, 512, fstderr);
   CU_ASSERT_STRING_EQUAL(line, "ERROR:  No branch or commit branch exists.\n");
@@ -438,7 +448,7 @@ void test_remove_errors_1(void)
   //try removing when there is nothing in .index
   retval = beargit_rm("a");
   CU_ASSERT(0 != retval);
-  FILE* fstderr = fopen("TEST_STDERR", "r");
+  FILE* fstderr = capture_open(stderr);
   CU_ASSERT_PTR_NOT_NULL(fstderr);
   char line[512];
   CU_ASSERT_PTR_NOT_NULL(fgets(line, 512, fstderr))
@@ -461,7 +471,7 @@ void test_remove_errors_2(void)
   CU_ASSERT(0 == retval);
   retval = beargit_rm("a");
   CU_ASSERT(0 != retval);
-  FILE* fstderr = fopen("TEST_STDERR", "r");
+  FILE* fstderr = capture_open(stderr);
   char line[512];
   CU_ASSERT_PTR_NOT_NULL(fstderr);
   CU_ASSERT_PTR_NOT_NULL(fgets(line, 512, fstderr));
@@ -494,7 +504,7 @@ void test_remove_errors_3(void)
   CU_ASSERT(0 != retval);
   retval = beargit_rm("b");
   CU_ASSERT(0 == retval);
-  FILE* fstderr = fopen("TEST_STDERR", "r");
+  FILE* fstderr = capture_open(stderr);
   char line[512];
   CU_ASSERT_PTR_NOT_NULL(fstderr);
   CU_ASSERT_PTR_NOT_NULL(fgets(line, 512, fstderr));
@@ -531,7 +541,7 @@ void test_remove_errors_4(void)
   CU_ASSERT(0 == retval);
   retval = beargit_rm("b");
   CU_ASSERT(0 != retval);
-  FILE* fstderr = fopen("TEST_STDERR", "r");
+  FILE* fstderr = capture_open(stderr);
   char line[512];
   CU_ASSERT_PTR_NOT_NULL(fstderr);
   CU_ASSERT_PTR_NOT_NULL(fgets(line, 512, fstderr));
@@ -592,7 +602,7 @@ void test_reset_error_cases(void)
   CU_ASSERT(0 != retval);
 
   char error[512];
-  FILE* fstderr = fopen("TEST_STDERR", "r");
+  FILE* fstderr = capture_open(stderr);
   fgets(error, 512, fstderr);
   char error1[512];
   sprintf(error1, "ERROR:  a is not in the index of commit %s.\n", first_id);
@@ -602,6 +612,1209 @@ void test_reset_error_cases(void)
   fclose(fstderr);
 }
 
+/****************
+**TEST IO ENGINE**
+*****************/
+void test_io_engines(void)
+{
+  const char* engines[] = { "sync", "threads", "uring" };
+  char name[32], content[64], line[64];
+
+  for (int e = 0; e < 3; e++) {
+    fs_force_rm_beargit_dir();
+    beargit_init();
+    setenv("BEARGIT_IO_ENGINE", engines[e], 1);
+
+    for (int i = 0; i < 2 * COPY_WINDOW + 3; i++) {
+      sprintf(name, "io%d", i);
+      sprintf(content, "%s %d", engines[e], i);
+      write_string_to_file(name, content);
+      beargit_add(name);
+    }
+    CU_ASSERT(0 == beargit_commit("THIS IS BEAR TERRITORY!"));
+    char commit_id[COMMIT_ID_SIZE];
+    read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
+
+    for (int i = 0; i < 2 * COPY_WINDOW + 3; i++) {
+      sprintf(name, "io%d", i);
+      write_string_to_file(name, "overwritten");
+    }
+    CU_ASSERT(0 == beargit_checkout(commit_id, 0));
+
+    for (int i = 0; i < 2 * COPY_WINDOW + 3; i++) {
+      sprintf(name, "io%d", i);
+      sprintf(content, "%s %d", engines[e], i);
+      read_string_from_file(name, line, sizeof(line));
+      CU_ASSERT_STRING_EQUAL(line, content);
+    }
+  }
+  unsetenv("BEARGIT_IO_ENGINE");
+}
+
+/*************
+**TEST INDEX**
+**************/
+void test_index_arena(void)
+{
+  beargit_init();
+
+  // Paths are no longer limited to FILENAME_SIZE
+  char long_path[2 * FILENAME_SIZE];
+  memset(long_path, 'x', sizeof(long_path) - 1);
+  long_path[sizeof(long_path) - 1] = '\0';
+
+  struct arena arena;
+  arena_init(&arena);
+  struct index index;
+  index_load(&arena, ".beargit/.index", &index);
+  CU_ASSERT(0 == index.count);
+  for (int i = 0; i < 1000; i++)
+    index_append(&arena, &index, arena_printf(&arena, "file%d", i));
+  index_append(&arena, &index, long_path);
+  index_write(".beargit/.index", &index);
+
+  struct index reloaded;
+  index_load(&arena, ".beargit/.index", &reloaded);
+  CU_ASSERT(1001 == reloaded.count);
+  CU_ASSERT_STRING_EQUAL(reloaded.paths[1000], long_path);
+  // Both loads share the interned strings
+  CU_ASSERT(reloaded.paths[7] == index.paths[7]);
+  CU_ASSERT(999 == index_find(&reloaded, "file999"));
+  CU_ASSERT(-1 == index_find(&reloaded, "file1000"));
+  arena_free(&arena);
+}
+
+/*************
+**TEST TRACE**
+**************/
+void test_trace_counters(void)
+{
+  beargit_init();
+  write_string_to_file("a", "traced");
+  beargit_add("a");
+
+  trace_enabled = 1;
+  memset(trace_counters, 0, sizeof(trace_counters));
+  int retval = beargit_commit("THIS IS BEAR TERRITORY!");
+  trace_enabled = 0;
+  CU_ASSERT(0 == retval);
+
+  // .index, .prev and the tracked file are copied into the commit directory
+  CU_ASSERT(3 == trace_counters[TRACE_FILES_COPIED]);
+  // ...which is created along with its .beargit/objects/ab shard
+  CU_ASSERT(2 == trace_counters[TRACE_DIRS_CREATED]);
+  // .index, and the .digests written while copying
+  CU_ASSERT(2 == trace_counters[TRACE_INDEX_ENTRIES]);
+  CU_ASSERT(trace_counters[TRACE_BYTES_MOVED] > 0);
+
+  // Nothing is recorded while tracing is off
+  memset(trace_counters, 0, sizeof(trace_counters));
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  CU_ASSERT(0 == trace_counters[TRACE_FILES_COPIED]);
+}
+
+/*****************
+**TEST FSMONITOR**
+******************/
+void test_fsmonitor_commit(void)
+{
+  beargit_init();
+  write_string_to_file("a", "unchanged");
+  write_string_to_file("b", "before");
+  beargit_add("a");
+  beargit_add("b");
+
+  CU_ASSERT(0 == beargit_fsmonitor("start"));
+  CU_ASSERT(0 == beargit_commit("THIS IS BEAR TERRITORY!"));
+  write_string_to_file("b", "after");
+  CU_ASSERT(0 == beargit_commit("THIS IS BEAR TERRITORY!"));
+
+  char commit_id[COMMIT_ID_SIZE];
+  char path[FILENAME_SIZE];
+  struct stat s;
+  read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
+
+  // a is shared with the parent snapshot, b was copied
+  commit_path(path, commit_id, "a");
+  CU_ASSERT(0 == stat(path, &s));
+  CU_ASSERT(2 == s.st_nlink);
+  commit_path(path, commit_id, "b");
+  CU_ASSERT(0 == stat(path, &s));
+  CU_ASSERT(1 == s.st_nlink);
+
+  char line[512];
+  read_string_from_file(path, line, 512);
+  CU_ASSERT_STRING_EQUAL(line, "after");
+
+  CU_ASSERT(0 == beargit_fsmonitor("stop"));
+}
+
+/*****************
+**TEST CHUNKING**
+******************/
+int count_chunks(void)
+{
+  FILE* p = popen("find .beargit/.chunks -type f | wc -l", "r");
+  int count = 0;
+  fscanf(p, "%d", &count);
+  pclose(p);
+  return count;
+}
+
+void test_chunked_commit(void)
+{
+  beargit_init();
+
+  int size = 3 * CHUNK_THRESHOLD;
+  char* data = malloc(size);
+  srand(61);
+  for (int i = 0; i < size; i++)
+    data[i] = rand();
+  FILE* big = fopen("big", "w");
+  fwrite(data, 1, size, big);
+  fclose(big);
+
+  beargit_add("big");
+  CU_ASSERT(0 == beargit_commit("THIS IS BEAR TERRITORY!"));
+  char first_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", first_id, COMMIT_ID_SIZE);
+  char snapshot[FILENAME_SIZE];
+  commit_path(snapshot, first_id, "big");
+  CU_ASSERT(fs_is_chunk_list(snapshot));
+  CU_ASSERT(fs_snapshot_matches(snapshot, "big"));
+  int chunks = count_chunks();
+  CU_ASSERT(chunks > 2);
+
+  // Changing a few bytes in the middle only adds a chunk or two
+  big = fopen("big", "r+");
+  fseek(big, size / 2, SEEK_SET);
+  fwrite("changed", 1, 7, big);
+  fclose(big);
+  CU_ASSERT(!fs_snapshot_matches(snapshot, "big"));
+  CU_ASSERT(0 == beargit_commit("THIS IS BEAR TERRITORY!"));
+  CU_ASSERT(count_chunks() - chunks <= 2);
+
+  // Both versions are reassembled correctly
+  CU_ASSERT(0 == beargit_reset(first_id, "big"));
+  char* restored = malloc(size);
+  big = fopen("big", "r");
+  CU_ASSERT(size == fread(restored, 1, size, big));
+  CU_ASSERT(EOF == fgetc(big));
+  fclose(big);
+  CU_ASSERT(0 == memcmp(data, restored, size));
+
+  free(data);
+  free(restored);
+}
+
+/**********
+**TEST GC**
+***********/
+void test_gc(void)
+{
+  beargit_init();
+  write_string_to_file("a", "kept");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char master_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", master_id, COMMIT_ID_SIZE);
+
+  // A branch with a chunked file that is abandoned afterwards
+  beargit_checkout("side", 1);
+  int size = CHUNK_THRESHOLD + 4096;
+  char* data = malloc(size);
+  srand(32);
+  for (int i = 0; i < size; i++)
+    data[i] = rand();
+  FILE* big = fopen("big", "w");
+  fwrite(data, 1, size, big);
+  fclose(big);
+  free(data);
+  beargit_add("big");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char side_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", side_id, COMMIT_ID_SIZE);
+  CU_ASSERT(1 == beargit_branch_delete("side"));
+  beargit_checkout("master", 0);
+  CU_ASSERT(0 == beargit_branch_delete("side"));
+  CU_ASSERT(-1 == get_branch_number("side"));
+
+  char side_dir[FILENAME_SIZE];
+  commit_path(side_dir, side_id, NULL);
+  char master_dir[FILENAME_SIZE];
+  commit_path(master_dir, master_id, NULL);
+
+  // The abandoned commit is still within the default grace period
+  CU_ASSERT(0 == beargit_gc(NULL));
+  CU_ASSERT(fs_check_dir_exists(side_dir));
+  CU_ASSERT(1 == beargit_gc("2x"));
+
+  CU_ASSERT(0 == beargit_gc("0"));
+  CU_ASSERT(!fs_check_dir_exists(side_dir));
+  CU_ASSERT(fs_check_dir_exists(master_dir));
+  CU_ASSERT(0 == count_chunks());
+  CU_ASSERT(access(".beargit/.gc_lock", F_OK) != 0);
+
+  // Reachable history still checks out
+  CU_ASSERT(0 == beargit_checkout(master_id, 0));
+  char contents[8] = "";
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "kept");
+}
+
+// A branch deleted and created again doesn't reuse the ids of its
+// abandoned commits, which gc keeps around for the grace period.
+void test_branch_recreate(void)
+{
+  beargit_init();
+  write_string_to_file("a", "a");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  beargit_checkout("side", 1);
+  beargit_commit("THIS IS BEAR TERRITORY! side");
+  char abandoned[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", abandoned, COMMIT_ID_SIZE);
+  beargit_checkout("master", 0);
+  CU_ASSERT(0 == beargit_branch_delete("side"));
+
+  CU_ASSERT(0 == beargit_checkout("side", 1));
+  CU_ASSERT(0 == beargit_commit("THIS IS BEAR TERRITORY! side again"));
+  char recreated[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", recreated, COMMIT_ID_SIZE);
+  CU_ASSERT(0 != strcmp(abandoned, recreated));
+  char dir[FILENAME_SIZE];
+  commit_path(dir, abandoned, ".msg");
+  char msg[MSG_SIZE] = "";
+  read_string_from_file(dir, msg, MSG_SIZE);
+  CU_ASSERT_STRING_EQUAL(msg, "THIS IS BEAR TERRITORY! side");
+}
+
+/***************
+**TEST BITMAPS**
+****************/
+void test_rev_list_bitmaps(void)
+{
+  // Runs of ones and scattered bits survive compression
+  struct bitmap bitmap;
+  struct bitmap reloaded;
+  bitmap_init(&bitmap);
+  bitmap_init(&reloaded);
+  for (int i = 0; i < 10000; i++)
+    bitmap_set(&bitmap, i);
+  bitmap_set(&bitmap, 20000);
+  bitmap_set(&bitmap, 100003);
+  bitmap_write("bitmap", &bitmap, 42);
+  uint32_t position;
+  CU_ASSERT(0 == bitmap_read("bitmap", &reloaded, &position));
+  CU_ASSERT(42 == position);
+  CU_ASSERT(10002 == bitmap_count(&reloaded));
+  CU_ASSERT(bitmap_get(&reloaded, 100003));
+  CU_ASSERT(!bitmap_get(&reloaded, 100002));
+  bitmap_free(&bitmap);
+  bitmap_free(&reloaded);
+  unlink("bitmap");
+
+  beargit_init();
+  write_string_to_file("a", "a");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char base_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", base_id, COMMIT_ID_SIZE);
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  beargit_checkout("side", 1);
+  beargit_commit("THIS IS BEAR TERRITORY!");
+
+  CU_ASSERT(0 == beargit_is_ancestor(base_id, "side"));
+  CU_ASSERT(0 == beargit_is_ancestor("master", "side"));
+  CU_ASSERT(1 == beargit_is_ancestor("side", "master"));
+  CU_ASSERT(1 == beargit_is_ancestor("nope", "master"));
+
+  const char* side_only[] = { "side", "^master" };
+  CU_ASSERT(0 == beargit_rev_list(side_only, 2, 1));
+  const char* all[] = { "HEAD" };
+  CU_ASSERT(0 == beargit_rev_list(all, 1, 1));
+  FILE* fstdout = capture_open(stdout);
+  int side_count = 0;
+  int all_count = 0;
+  CU_ASSERT(2 == fscanf(fstdout, "%d\n%d", &side_count, &all_count));
+  CU_ASSERT(1 == side_count);
+  CU_ASSERT(3 == all_count);
+  fclose(fstdout);
+}
+
+/****************
+**TEST TRANSFER**
+*****************/
+void test_clone_fetch_push(void)
+{
+  system("rm -rf origin copy");
+  mkdir("origin", 0755);
+  chdir("origin");
+  beargit_init();
+  write_string_to_file("a", "one");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  chdir("..");
+
+  CU_ASSERT(0 == beargit_clone("origin", "copy"));
+  CU_ASSERT(1 == beargit_clone("origin", "copy"));
+  CU_ASSERT(1 == beargit_clone("nowhere", "copy2"));
+
+  // Only the new commit travels on fetch
+  chdir("origin");
+  write_string_to_file("a", "two");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char origin_head[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", origin_head, COMMIT_ID_SIZE);
+  chdir("../copy");
+  char contents[8] = "";
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "one");
+  CU_ASSERT(0 == beargit_fetch(NULL));
+  char fetched[COMMIT_ID_SIZE] = "";
+  CU_ASSERT(0 == resolve_rev("remote/master", fetched));
+  CU_ASSERT_STRING_EQUAL(fetched, origin_head);
+
+  // A new branch can be pushed, the remote's checked out branch can't
+  beargit_checkout("topic", 1);
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char topic_head[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", topic_head, COMMIT_ID_SIZE);
+  CU_ASSERT(0 == beargit_push(NULL, NULL));
+  CU_ASSERT(1 == beargit_push(NULL, "master"));
+  chdir("../origin");
+  char pushed[COMMIT_ID_SIZE] = "";
+  CU_ASSERT(0 == resolve_rev("topic", pushed));
+  CU_ASSERT_STRING_EQUAL(pushed, topic_head);
+  CU_ASSERT(0 == beargit_is_ancestor(origin_head, "master"));
+
+  // Repositories from before ids were salted make the same id for commits on
+  // the same branch and parent; fetch and push refuse to mix them up
+  unlink(".beargit/.salt");
+  CU_ASSERT(0 == beargit_checkout("topic", 0));
+  write_string_to_file("a", "origin");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  read_string_from_file(".beargit/.prev", origin_head, COMMIT_ID_SIZE);
+  chdir("../copy");
+  unlink(".beargit/.salt");
+  write_string_to_file("a", "copy");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  read_string_from_file(".beargit/.prev", topic_head, COMMIT_ID_SIZE);
+  CU_ASSERT_STRING_EQUAL(topic_head, origin_head);
+  capture_clear(stderr);
+  CU_ASSERT(1 == beargit_fetch(NULL));
+  CU_ASSERT(NULL != strstr(capture_get(stderr), "differs from the local commit"));
+  CU_ASSERT(0 == resolve_rev("remote/master", fetched));
+  CU_ASSERT(1 == beargit_push(NULL, NULL));
+  capture_clear(stderr);
+
+  // With a salt the next commits get different ids
+  write_string_to_file(".beargit/.salt", "0123456789abcdef0123456789abcdef");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  read_string_from_file(".beargit/.prev", topic_head, COMMIT_ID_SIZE);
+  chdir("../origin");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  read_string_from_file(".beargit/.prev", origin_head, COMMIT_ID_SIZE);
+  CU_ASSERT(0 != strcmp(topic_head, origin_head));
+  chdir("..");
+  system("rm -rf origin copy");
+}
+
+/**************
+**TEST BUNDLE**
+***************/
+void test_bundle(void)
+{
+  system("rm -rf imported test.bundle");
+  beargit_init();
+  write_string_to_file("a", "bundled");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char head[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  CU_ASSERT(0 == beargit_bundle("create", "test.bundle", NULL, 0));
+
+  // Flip a byte inside the first record
+  FILE* fbundle = fopen("test.bundle", "r");
+  fseek(fbundle, 0, SEEK_END);
+  long size = ftell(fbundle);
+  char* data = malloc(size);
+  rewind(fbundle);
+  fread(data, 1, size, fbundle);
+  fclose(fbundle);
+  char* record = strstr(data, "records\n") + 8;
+  record[strlen("commit ") + 3] ^= 1;
+  fbundle = fopen("corrupt.bundle", "w");
+  fwrite(data, 1, size, fbundle);
+  fclose(fbundle);
+  free(data);
+
+  mkdir("imported", 0755);
+  chdir("imported");
+  beargit_init();
+  CU_ASSERT(1 == beargit_bundle("unbundle", "../corrupt.bundle", NULL, 0));
+  // Sizes in records can't be negative
+  write_string_to_file("../negative.bundle", "beargit-bundle 1\nrecords\nchunk -1 a\n");
+  CU_ASSERT(1 == beargit_bundle("unbundle", "../negative.bundle", NULL, 0));
+  CU_ASSERT(NULL != strstr(capture_get(stderr), "is corrupt"));
+  char commits[8] = "";
+  CU_ASSERT(1 == beargit_bundle("unbundle", "../missing.bundle", NULL, 0));
+  CU_ASSERT(0 == beargit_bundle("unbundle", "../test.bundle", NULL, 0));
+  char imported[COMMIT_ID_SIZE] = "";
+  CU_ASSERT(0 == resolve_rev("remote/master", imported));
+  CU_ASSERT_STRING_EQUAL(imported, head);
+  CU_ASSERT(0 == beargit_checkout(head, 0));
+  read_string_from_file("a", commits, sizeof(commits));
+  CU_ASSERT_STRING_EQUAL(commits, "bundled");
+  // Importing again skips what is already there
+  CU_ASSERT(0 == beargit_bundle("unbundle", "../test.bundle", NULL, 0));
+  chdir("..");
+  system("rm -rf imported test.bundle corrupt.bundle negative.bundle");
+}
+
+void test_sparse_checkout(void)
+{
+  beargit_init();
+  write_string_to_file("a", "kept");
+  write_string_to_file("notes", "skipped");
+  beargit_add("a");
+  beargit_add("notes");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+
+  const char* patterns[] = { "*", "!n*" };
+  CU_ASSERT(0 == beargit_sparse("set", patterns, 2));
+  CU_ASSERT(access("a", F_OK) == 0);
+  CU_ASSERT(access("notes", F_OK) != 0);
+
+  // Skipped paths stay tracked and survive commits and checkouts
+  write_string_to_file("a", "changed");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  CU_ASSERT(0 == beargit_checkout("master", 0));
+  CU_ASSERT(access("notes", F_OK) != 0);
+
+  CU_ASSERT(0 == beargit_sparse("disable", NULL, 0));
+  char contents[16] = "";
+  read_string_from_file("notes", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "skipped");
+  CU_ASSERT(1 == beargit_sparse("bogus", NULL, 0));
+}
+
+void test_archive(void)
+{
+  beargit_init();
+  write_string_to_file("b", "second");
+  write_string_to_file("a", "first");
+  beargit_add("b");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  write_string_to_file("a", "not committed");
+
+  CU_ASSERT(0 == beargit_archive("HEAD", "tar", "one.tar"));
+  CU_ASSERT(0 == beargit_archive("master", NULL, "two.tar"));
+  CU_ASSERT(0 == system("cmp -s one.tar two.tar"));
+
+  // Entries are sorted and hold the committed contents
+  FILE* ftar = fopen("one.tar", "r");
+  char block[512];
+  CU_ASSERT(fread(block, 1, sizeof(block), ftar) == sizeof(block));
+  CU_ASSERT_STRING_EQUAL(block, "a");
+  CU_ASSERT(fread(block, 1, sizeof(block), ftar) == sizeof(block));
+  CU_ASSERT(strncmp(block, "first", 5) == 0);
+  fseek(ftar, 0, SEEK_END);
+  CU_ASSERT(ftell(ftar) % 10240 == 0);
+  fclose(ftar);
+
+  CU_ASSERT(1 == beargit_archive("HEAD", "zip", "three.zip"));
+  CU_ASSERT(access("three.zip", F_OK) != 0);
+  system("rm -f one.tar two.tar");
+}
+
+void test_reset_many(void)
+{
+  beargit_init();
+  write_string_to_file("a", "a1");
+  write_string_to_file("b", "b1");
+  beargit_add("a");
+  beargit_add("b");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char first_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", first_id, COMMIT_ID_SIZE);
+  write_string_to_file("a", "a2");
+  write_string_to_file("b", "b2");
+  beargit_rm("b");
+
+  // Nothing is touched if one of the files is missing
+  const char* bad[] = { "a", "missing" };
+  CU_ASSERT(1 == beargit_reset_paths(first_id, bad, 2));
+  char contents[8] = "";
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "a2");
+
+  const char* paths[] = { "a", "b", "a" };
+  CU_ASSERT(0 == beargit_reset_paths(first_id, paths, 3));
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "a1");
+  read_string_from_file("b", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "b1");
+  struct arena arena;
+  struct index index;
+  arena_init(&arena);
+  index_load(&arena, ".beargit/.index", &index);
+  CU_ASSERT(index.count == 2);
+  arena_free(&arena);
+
+  // Without paths the whole commit is reset
+  write_string_to_file("b", "b3");
+  CU_ASSERT(0 == beargit_reset_paths(first_id, NULL, 0));
+  read_string_from_file("b", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "b1");
+}
+
+// Number of commits printed to stdout since the capture was last cleared.
+static int count_logged_commits(void)
+{
+  FILE* fstdout = capture_open(stdout);
+  if (fstdout == NULL)
+    return 0;
+  char line[512];
+  int count = 0;
+  while (fgets(line, sizeof(line), fstdout))
+    count += strncmp(line, "commit ", 7) == 0;
+  fclose(fstdout);
+  capture_clear(stdout);
+  return count;
+}
+
+void test_log_grep(void)
+{
+  beargit_init();
+  write_string_to_file("a", "a");
+  beargit_add("a");
+  CU_ASSERT(1 == beargit_log_grep("fix", 10));
+  beargit_commit("THIS IS BEAR TERRITORY! fix parser");
+  beargit_commit("THIS IS BEAR TERRITORY! add docs");
+  capture_clear(stdout);
+
+  // Indexed
+  CU_ASSERT(0 == beargit_log_grep("fix", 10));
+  CU_ASSERT(1 == count_logged_commits());
+  // Commits made after the index was built are picked up
+  beargit_commit("THIS IS BEAR TERRITORY! fix lexer");
+  capture_clear(stdout);
+  CU_ASSERT(0 == beargit_log_grep("fix l.xer$", 10));
+  CU_ASSERT(1 == count_logged_commits());
+  CU_ASSERT(0 == beargit_log_grep("TERRITORY", 2));
+  CU_ASSERT(2 == count_logged_commits());
+  // Scanned
+  CU_ASSERT(0 == beargit_log_grep("docs|parser", 10));
+  CU_ASSERT(2 == count_logged_commits());
+  CU_ASSERT(0 == beargit_log_grep("nothing", 10));
+  CU_ASSERT(0 == count_logged_commits());
+  CU_ASSERT(1 == beargit_log_grep("(", 10));
+
+  // Entries pointing past the postings make the index rebuild
+  FILE* index = fopen(".beargit/.grep_index", "r+");
+  CU_ASSERT(index != NULL);
+  uint32_t header[3];
+  CU_ASSERT(1 == fread(header, sizeof(header), 1, index));
+  uint32_t offset = 0x7fffffff;
+  for (uint32_t i = 0; i < header[2]; i++) {
+    fseek(index, sizeof(header) + 12 * i + 8, SEEK_SET);
+    fwrite(&offset, sizeof(offset), 1, index);
+  }
+  fclose(index);
+  CU_ASSERT(0 == beargit_log_grep("fix", 10));
+  CU_ASSERT(2 == count_logged_commits());
+}
+
+// write_string_to_file also writes the terminating NUL.
+static void write_lines(const char* filename, const char* lines)
+{
+  FILE* fout = fopen(filename, "w");
+  fputs(lines, fout);
+  fclose(fout);
+}
+
+void test_blame(void)
+{
+  beargit_init();
+  write_lines("f", "one\ntwo\nthree\n");
+  beargit_add("f");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char first_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", first_id, COMMIT_ID_SIZE);
+  write_lines("f", "zero\none\nTWO\nthree\n");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  char second_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", second_id, COMMIT_ID_SIZE);
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  capture_clear(stdout);
+
+  CU_ASSERT(0 == beargit_blame("f", NULL));
+  // Blaming again reads the cached result
+  CU_ASSERT(0 == beargit_blame("f", "HEAD"));
+  FILE* fstdout = capture_open(stdout);
+  CU_ASSERT_PTR_NOT_NULL(fstdout);
+  char line[128];
+  char expected[128];
+  const char* owners[] = { second_id, first_id, second_id, first_id };
+  const char* lines[] = { "zero", "one", "TWO", "three" };
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < 4; i++) {
+      sprintf(expected, "%.8s %5d) %s\n", owners[i], i + 1, lines[i]);
+      CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+      CU_ASSERT_STRING_EQUAL(line, expected);
+    }
+  }
+  CU_ASSERT_PTR_NULL(fgets(line, sizeof(line), fstdout));
+  fclose(fstdout);
+
+  CU_ASSERT(1 == beargit_blame("missing", NULL));
+}
+
+void test_log_paths(void)
+{
+  beargit_init();
+  write_string_to_file("a", "a");
+  write_string_to_file("b", "b");
+  beargit_add("a");
+  beargit_add("b");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  for (int i = 0; i < 5; i++)
+  {
+    char contents[8];
+    sprintf(contents, "b%d", i);
+    write_string_to_file("b", contents);
+    beargit_commit("THIS IS BEAR TERRITORY!");
+  }
+  beargit_rm("a");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  capture_clear(stdout);
+
+  const char* a[] = { "a" };
+  const char* b[] = { "b" };
+  const char* both[] = { "a", "b" };
+  CU_ASSERT(0 == beargit_log_paths(a, 1, 10));
+  // Added and removed
+  CU_ASSERT(2 == count_logged_commits());
+  CU_ASSERT(0 == beargit_log_paths(b, 1, 10));
+  CU_ASSERT(6 == count_logged_commits());
+  CU_ASSERT(0 == beargit_log_paths(both, 2, 3));
+  CU_ASSERT(3 == count_logged_commits());
+
+  // Commits without a filter are still found
+  char head[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  char bloom[FILENAME_SIZE];
+  commit_path(bloom, head, ".bloom");
+  unlink(bloom);
+  CU_ASSERT(0 == beargit_log_paths(a, 1, 10));
+  CU_ASSERT(2 == count_logged_commits());
+
+  // Rewriting a file with the same content doesn't change it, even for a
+  // commit that lost its filter and its manifest
+  write_string_to_file("b", "b4");
+  beargit_commit("THIS IS BEAR TERRITORY!");
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  char manifest[FILENAME_SIZE];
+  commit_path(bloom, head, ".bloom");
+  commit_path(manifest, head, ".manifest");
+  CU_ASSERT(0 == unlink(bloom));
+  CU_ASSERT(0 == unlink(manifest));
+  CU_ASSERT(0 == beargit_log_paths(b, 1, 10));
+  CU_ASSERT(6 == count_logged_commits());
+}
+
+void test_ignore_untracked(void)
+{
+  beargit_init();
+  system("rm -rf src build");
+  mkdir("src", 0755);
+  mkdir("src/lib", 0755);
+  mkdir("build", 0755);
+  write_string_to_file("src/a.c", "a");
+  write_string_to_file("src/lib/b.c", "b");
+  write_string_to_file("src/lib/b.o", "object");
+  write_string_to_file("build/out", "out");
+  write_lines(".beargitignore", "# build products\n*.o\nbuild/\n!keep.o\n");
+  write_string_to_file("src/keep.o", "kept");
+
+  struct arena arena;
+  struct ignore_rules rules;
+  arena_init(&arena);
+  ignore_load(&arena, ".beargitignore", &rules);
+  CU_ASSERT(ignore_match(&rules, "src/lib/b.o", 0));
+  CU_ASSERT(!ignore_match(&rules, "src/keep.o", 0));
+  CU_ASSERT(ignore_match(&rules, "build", 1));
+  CU_ASSERT(!ignore_match(&rules, "build", 0));
+  CU_ASSERT(!ignore_match(&rules, "src/a.c", 0));
+  arena_free(&arena);
+
+  CU_ASSERT(0 == beargit_add_tree("src/"));
+  CU_ASSERT(0 == beargit_commit("THIS IS BEAR TERRITORY!"));
+  struct index index;
+  arena_init(&arena);
+  index_load(&arena, ".beargit/.index", &index);
+  CU_ASSERT(index.count == 3);
+  CU_ASSERT(index_find(&index, "src/lib/b.c") >= 0);
+  CU_ASSERT(index_find(&index, "src/lib/b.o") < 0);
+  arena_free(&arena);
+
+  // Nested files come back on checkout
+  system("rm -rf src");
+  CU_ASSERT(0 == beargit_checkout("master", 0));
+  char contents[8] = "";
+  read_string_from_file("src/lib/b.c", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "b");
+
+  capture_clear(stdout);
+  CU_ASSERT(0 == beargit_status_untracked());
+  FILE* fstdout = capture_open(stdout);
+  char line[128];
+  int untracked = 0;
+  int listed_ignored = 0;
+  while (fgets(line, sizeof(line), fstdout))
+  {
+    untracked += strcmp(line, ".beargitignore\n") == 0;
+    listed_ignored += strncmp(line, "build", 5) == 0 || strstr(line, "b.o") != NULL;
+  }
+  fclose(fstdout);
+  CU_ASSERT(untracked == 1);
+  CU_ASSERT(listed_ignored == 0);
+
+  // Directories outside the working tree or inside .beargit are refused, and
+  // dotfiles are left out like with beargit add <file>
+  CU_ASSERT(1 == beargit_add_tree(".."));
+  CU_ASSERT(1 == beargit_add_tree("src/../.."));
+  CU_ASSERT(1 == beargit_add_tree("/tmp"));
+  CU_ASSERT(1 == beargit_add_tree("./.beargit"));
+  mkdir("nested", 0755);
+  mkdir("nested/.beargit", 0755);
+  write_string_to_file("nested/.beargit/.prev", "x");
+  write_string_to_file("nested/c", "c");
+  CU_ASSERT(0 == beargit_add_tree("."));
+  arena_init(&arena);
+  index_load(&arena, ".beargit/.index", &index);
+  CU_ASSERT(index_find(&index, "nested/c") >= 0);
+  CU_ASSERT(index_find(&index, "nested/.beargit/.prev") < 0);
+  CU_ASSERT(index_find(&index, ".beargitignore") < 0);
+  arena_free(&arena);
+  system("rm -rf src build nested .beargitignore");
+}
+
+void test_short_ids(void)
+{
+  char first[COMMIT_ID_SIZE] = "";
+  char head[COMMIT_ID_SIZE] = "";
+  char commit_id[COMMIT_ID_SIZE] = "";
+  char prefix[8] = "";
+  beargit_init();
+  write_string_to_file("a", "one");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY! one");
+  read_string_from_file(".beargit/.prev", first, COMMIT_ID_SIZE);
+  write_string_to_file("a", "two");
+  beargit_commit("THIS IS BEAR TERRITORY! two");
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+
+  snprintf(prefix, sizeof(prefix), "%s", head);
+  CU_ASSERT(0 == expand_commit_id(prefix, commit_id));
+  CU_ASSERT(0 == strcmp(commit_id, head));
+  CU_ASSERT(1 == expand_commit_id("abc", commit_id));
+  CU_ASSERT(1 == expand_commit_id("xyzw", commit_id));
+
+  // log, reset and checkout all take a prefix
+  snprintf(prefix, sizeof(prefix), "%s", first);
+  CU_ASSERT(0 == beargit_log_rev(prefix, INT_MAX));
+  CU_ASSERT(1 == count_logged_commits());
+  CU_ASSERT(0 == beargit_reset(prefix, "a"));
+  char contents[8] = "";
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT(0 == strcmp(contents, "one"));
+  CU_ASSERT(0 == beargit_checkout(prefix, 0));
+  read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
+  CU_ASSERT(0 == strcmp(commit_id, first));
+
+  // Two commits sharing a prefix
+  const char* ids[] = { "abcd100000000000000000000000000000000000",
+                        "abcd200000000000000000000000000000000000" };
+  FILE* table = fopen(".beargit/.commits", "a");
+  for (int i = 0; i < 2; i++) {
+    char dir[FILENAME_SIZE];
+    commit_path(dir, ids[i], NULL);
+    fs_mkdir_parents(dir);
+    mkdir(dir, 0755);
+    fprintf(table, "%s\n", ids[i]);
+  }
+  fclose(table);
+  CU_ASSERT(2 == expand_commit_id("abcd", commit_id));
+  CU_ASSERT(1 == beargit_checkout("abcd", 0));
+  CU_ASSERT(0 == expand_commit_id("abcd2", commit_id));
+  CU_ASSERT(0 == strcmp(commit_id, ids[1]));
+  // Removed commits don't count
+  char dir[FILENAME_SIZE];
+  commit_path(dir, ids[1], NULL);
+  rmdir(dir);
+  CU_ASSERT(0 == expand_commit_id("abcd", commit_id));
+  CU_ASSERT(0 == strcmp(commit_id, ids[0]));
+}
+
+void test_fast_import(void)
+{
+  beargit_init();
+  FILE* stream = fopen("stream", "w");
+  fprintf(stream, "commit master\ndata 3\none\nM a\ndata 4\nold\n\nM dir/b\ndata 2\nb\n\n\n");
+  fprintf(stream, "commit master\ndata 3\ntwo\nM a\ndata 4\nnew\n\nD dir/b\n\n");
+  fprintf(stream, "commit topic\nfrom master\ndata 5\nthree\nM c\ndata 2\nc\n\n");
+  fclose(stream);
+  CU_ASSERT(0 == beargit_fast_import("stream"));
+  capture_clear(stdout);
+
+  // The checked out branch is updated along with the working directory
+  char contents[8] = "";
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT(0 == strcmp(contents, "new\n"));
+  CU_ASSERT(access("dir/b", F_OK) != 0);
+  CU_ASSERT(0 == beargit_log(INT_MAX));
+  CU_ASSERT(2 == count_logged_commits());
+  CU_ASSERT(0 == beargit_checkout("topic", 0));
+  CU_ASSERT(access("c", F_OK) == 0);
+  CU_ASSERT(0 == beargit_log(INT_MAX));
+  CU_ASSERT(3 == count_logged_commits());
+
+  // A malformed stream keeps the commits before the bad one
+  stream = fopen("stream", "w");
+  fprintf(stream, "commit topic\ndata 4\nfour\nM d\ndata 2\nd\n\n");
+  fprintf(stream, "commit topic\ndata 4\nfive\nD missing\n");
+  fclose(stream);
+  CU_ASSERT(1 == beargit_fast_import("stream"));
+  CU_ASSERT(access("d", F_OK) == 0);
+  CU_ASSERT(0 == beargit_log(INT_MAX));
+  CU_ASSERT(4 == count_logged_commits());
+  CU_ASSERT(1 == beargit_fast_import("no-such-stream"));
+
+  // Uncommitted work isn't overwritten by checking out the imported head
+  write_string_to_file("c", "local");
+  stream = fopen("stream", "w");
+  fprintf(stream, "commit topic\ndata 3\nsix\nM c\ndata 2\n6\n\n");
+  fclose(stream);
+  capture_clear(stderr);
+  CU_ASSERT(1 == beargit_fast_import("stream"));
+  CU_ASSERT(NULL != strstr(capture_get(stderr), "local changes"));
+  read_string_from_file("c", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "local");
+  CU_ASSERT(0 == beargit_log(INT_MAX));
+  CU_ASSERT(4 == count_logged_commits());
+
+  // Two commits on one branch from the same parent get different ids
+  FILE* fc = fopen("c", "w");
+  fputs("c\n", fc);
+  fclose(fc);
+  stream = fopen("stream", "w");
+  fprintf(stream, "commit side\nfrom master\ndata 5\nseven\nM e\ndata 2\ne\n\n");
+  fprintf(stream, "commit side\nfrom master\ndata 5\neight\nM e\ndata 2\nf\n\n");
+  fclose(stream);
+  CU_ASSERT(0 == beargit_fast_import("stream"));
+  char side[COMMIT_ID_SIZE] = "";
+  char master[COMMIT_ID_SIZE] = "";
+  char parent[COMMIT_ID_SIZE] = "";
+  char path[FILENAME_SIZE];
+  CU_ASSERT(0 == resolve_rev("side", side));
+  CU_ASSERT(0 == resolve_rev("master", master));
+  commit_path(path, side, ".prev");
+  read_string_from_file(path, parent, COMMIT_ID_SIZE);
+  CU_ASSERT_STRING_EQUAL(parent, master);
+  unlink("stream");
+}
+
+void test_fast_export(void)
+{
+  beargit_init();
+  write_string_to_file("a", "one");
+  write_string_to_file("b", "gone");
+  beargit_add("a");
+  beargit_add("b");
+  beargit_commit("THIS IS BEAR TERRITORY! one");
+  beargit_checkout("side", 1);
+  write_string_to_file("a", "side");
+  beargit_rm("b");
+  beargit_commit("THIS IS BEAR TERRITORY! side");
+  CU_ASSERT(0 == beargit_fast_export("export"));
+
+  // Unchanged files aren't written again
+  char line[256];
+  int modified = 0;
+  int removed = 0;
+  FILE* stream = fopen("export", "r");
+  while (fgets(line, sizeof(line), stream)) {
+    modified += strncmp(line, "M ", 2) == 0;
+    removed += strcmp(line, "D b\n") == 0;
+  }
+  fclose(stream);
+  CU_ASSERT(3 == modified);
+  CU_ASSERT(1 == removed);
+
+  // Importing the stream gives back the same commits, under the ids of the
+  // importing repository
+  char head[COMMIT_ID_SIZE] = "";
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  mkdir("imported", 0755);
+  chdir("imported");
+  beargit_init();
+  CU_ASSERT(0 == beargit_fast_import("../export"));
+  char imported[COMMIT_ID_SIZE] = "";
+  CU_ASSERT(0 == resolve_rev("side", imported));
+  CU_ASSERT(0 != strcmp(imported, head));
+  char msg[MSG_SIZE] = "";
+  char path[FILENAME_SIZE];
+  commit_path(path, imported, ".msg");
+  read_string_from_file(path, msg, MSG_SIZE);
+  CU_ASSERT_STRING_EQUAL(msg, "THIS IS BEAR TERRITORY! side");
+  CU_ASSERT(0 == beargit_checkout("side", 0));
+  char contents[8] = "";
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "side");
+  CU_ASSERT(access("b", F_OK) != 0);
+  chdir("..");
+  system("rm -rf imported export");
+}
+
+void test_object_cache(void)
+{
+  beargit_init();
+  write_string_to_file("a", "cached");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY! one");
+  char commit_id[COMMIT_ID_SIZE] = "";
+  read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
+  char snapshot[FILENAME_SIZE];
+  commit_path(snapshot, commit_id, "a");
+  CU_ASSERT(is_object_path(snapshot));
+  CU_ASSERT(!is_object_path(".beargit/.prev"));
+
+  size_t size;
+  char* data = object_read(snapshot, &size);
+  CU_ASSERT(data != NULL && size == 7 && strcmp(data, "cached") == 0);
+  free(data);
+  data = object_read(snapshot, &size);
+  CU_ASSERT(data != NULL && strcmp(data, "cached") == 0);
+  free(data);
+
+  // A file that changes underneath the cache is read again
+  unlink(snapshot);
+  write_string_to_file(snapshot, "replaced");
+  data = object_read(snapshot, &size);
+  CU_ASSERT(data != NULL && strcmp(data, "replaced") == 0);
+  free(data);
+  unlink(snapshot);
+  CU_ASSERT(NULL == object_read(snapshot, &size));
+}
+
+void test_output_capture(void)
+{
+  // Output of any length is kept, in order, per stream
+  char long_line[5000];
+  memset(long_line, 'x', sizeof(long_line) - 1);
+  long_line[sizeof(long_line) - 1] = '\0';
+  fake_print("%s\n", long_line);
+  fake_fprint(stderr, "error %d\n", 1);
+  fake_fprint(stdout, "done\n");
+  const char* out = capture_get(stdout);
+  CU_ASSERT(strlen(out) == sizeof(long_line) + 5);
+  CU_ASSERT(0 == strcmp(out + sizeof(long_line), "done\n"));
+  CU_ASSERT_STRING_EQUAL(capture_get(stderr), "error 1\n");
+
+  FILE* fstderr = capture_open(stderr);
+  char line[32];
+  CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstderr));
+  CU_ASSERT_STRING_EQUAL(line, "error 1\n");
+  CU_ASSERT_PTR_NULL(fgets(line, sizeof(line), fstderr));
+  fclose(fstderr);
+
+  capture_clear(stdout);
+  CU_ASSERT_STRING_EQUAL(capture_get(stdout), "");
+  CU_ASSERT_STRING_EQUAL(capture_get(stderr), "error 1\n");
+  fstderr = capture_open(stdout);
+  CU_ASSERT_PTR_NULL(fgets(line, sizeof(line), fstderr));
+  fclose(fstderr);
+}
+
+void test_migrate_objects(void)
+{
+  beargit_init();
+  write_string_to_file("a", "one");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY! one");
+  char first[COMMIT_ID_SIZE] = "";
+  read_string_from_file(".beargit/.prev", first, COMMIT_ID_SIZE);
+  write_string_to_file("a", "two");
+  beargit_commit("THIS IS BEAR TERRITORY! two");
+  char second[COMMIT_ID_SIZE] = "";
+  read_string_from_file(".beargit/.prev", second, COMMIT_ID_SIZE);
+
+  // Lay the commits out the way older repositories did, with the migration
+  // interrupted after moving the second one
+  char path[FILENAME_SIZE];
+  char flat[FILENAME_SIZE];
+  commit_path(path, first, NULL);
+  sprintf(flat, ".beargit/%s", first);
+  CU_ASSERT(0 == rename(path, flat));
+  char shard[FILENAME_SIZE];
+  char moved[FILENAME_SIZE];
+  sprintf(shard, ".beargit/objects/%.2s", second);
+  sprintf(moved, ".beargit/objects.new/%.2s", second);
+  mkdir(".beargit/objects.new", 0755);
+  CU_ASSERT(0 == rename(shard, moved));
+  system("rm -rf .beargit/objects");
+  object_layout_reset();
+
+  CU_ASSERT(0 == beargit_log(10));
+  CU_ASSERT(NULL != strstr(capture_get(stdout), first));
+  CU_ASSERT(NULL != strstr(capture_get(stdout), second));
+  capture_clear(stdout);
+
+  CU_ASSERT(0 == beargit_migrate_objects());
+  CU_ASSERT_STRING_EQUAL(capture_get(stdout), "Moved 1 commits into .beargit/objects.\n");
+  CU_ASSERT(access(".beargit/objects.new", F_OK) != 0);
+  CU_ASSERT(access(flat, F_OK) != 0);
+  commit_path(path, first, ".msg");
+  CU_ASSERT(0 == strncmp(path, ".beargit/objects/", 17));
+  CU_ASSERT(0 == access(path, F_OK));
+
+  CU_ASSERT(0 == beargit_checkout(first, 0));
+  char contents[8] = "";
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "one");
+  capture_clear(stdout);
+  CU_ASSERT(0 == beargit_migrate_objects());
+  CU_ASSERT_STRING_EQUAL(capture_get(stdout), "Commits are already stored in .beargit/objects.\n");
+}
+
+void test_show_manifest(void)
+{
+  beargit_init();
+  write_string_to_file("a", "one");
+  write_string_to_file("b", "gone");
+  beargit_add("a");
+  beargit_add("b");
+  beargit_commit("THIS IS BEAR TERRITORY! one");
+  char first[COMMIT_ID_SIZE] = "";
+  read_string_from_file(".beargit/.prev", first, COMMIT_ID_SIZE);
+  write_string_to_file("a", "two");
+  write_string_to_file("c", "new");
+  beargit_rm("b");
+  beargit_add("c");
+  beargit_commit("THIS IS BEAR TERRITORY! two");
+  char head[COMMIT_ID_SIZE] = "";
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  capture_clear(stdout);
+
+  char expected[256];
+  sprintf(expected, "commit %s\n   THIS IS BEAR TERRITORY! two\n\nM a\nA c\nD b\n", head);
+  CU_ASSERT(0 == beargit_show(NULL));
+  CU_ASSERT_STRING_EQUAL(capture_get(stdout), expected);
+  capture_clear(stdout);
+
+  // Commits from before manifests compare their snapshots instead
+  char manifest[FILENAME_SIZE];
+  commit_path(manifest, head, ".manifest");
+  CU_ASSERT(0 == unlink(manifest));
+  CU_ASSERT(0 == beargit_show(head));
+  CU_ASSERT_STRING_EQUAL(capture_get(stdout), expected);
+  capture_clear(stdout);
+
+  CU_ASSERT(0 == beargit_show(first));
+  CU_ASSERT(NULL != strstr(capture_get(stdout), "\n\nA a\nA b\n"));
+  capture_clear(stdout);
+
+  // Rewriting a file with the same content leaves it out: the digests taken
+  // while copying both snapshots match
+  write_string_to_file("a", "two");
+  write_string_to_file("c", "newer");
+  beargit_commit("THIS IS BEAR TERRITORY! three");
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  char digests[FILENAME_SIZE];
+  commit_path(digests, head, ".digests");
+  CU_ASSERT(0 == access(digests, F_OK));
+  CU_ASSERT(0 == beargit_show(head));
+  CU_ASSERT(NULL != strstr(capture_get(stdout), "three\n\nM c\n"));
+  capture_clear(stdout);
+}
+
+void test_stash(void)
+{
+  beargit_init();
+  write_string_to_file("a", "one");
+  write_string_to_file("b", "same");
+  beargit_add("a");
+  beargit_add("b");
+  beargit_commit("THIS IS BEAR TERRITORY! one");
+  CU_ASSERT(0 == beargit_stash(NULL));
+  CU_ASSERT_STRING_EQUAL(capture_get(stdout), "No local changes to save.\n");
+  capture_clear(stdout);
+
+  // Only the changed files are set aside, and the working tree is back at HEAD
+  write_string_to_file("a", "edited");
+  write_string_to_file("c", "new");
+  beargit_add("c");
+  CU_ASSERT(0 == beargit_stash(NULL));
+  CU_ASSERT_STRING_EQUAL(capture_get(stdout), "Saved 2 changed files as stash 0.\n");
+  char contents[16] = "";
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "one");
+  CU_ASSERT(access("c", F_OK) != 0);
+  CU_ASSERT(access(".beargit/.stash/0/b", F_OK) != 0);
+  CU_ASSERT(fs_is_chunk_list(".beargit/.stash/0/a"));
+  char index[64] = "";
+  read_string_from_file(".beargit/.index", index, sizeof(index) - 1);
+  CU_ASSERT_STRING_EQUAL(index, "a\nb\n");
+
+  // A file with changes of its own isn't overwritten
+  write_string_to_file("a", "local");
+  CU_ASSERT(1 == beargit_stash("pop"));
+  CU_ASSERT(NULL != strstr(capture_get(stderr), "Local changes to a would be overwritten"));
+  write_string_to_file("a", "one");
+
+  // The changes can be taken to another branch
+  CU_ASSERT(0 == beargit_checkout("side", 1));
+  capture_clear(stdout);
+  CU_ASSERT(0 == beargit_stash("pop"));
+  CU_ASSERT_STRING_EQUAL(capture_get(stdout), "Restored 2 changed files from stash 0.\n");
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "edited");
+  read_string_from_file("c", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "new");
+  memset(index, 0, sizeof(index));
+  read_string_from_file(".beargit/.index", index, sizeof(index) - 1);
+  CU_ASSERT_STRING_EQUAL(index, "a\nb\nc\n");
+  CU_ASSERT(access(".beargit/.stash/0", F_OK) != 0);
+  CU_ASSERT(1 == beargit_stash("pop"));
+
+  // A file changed on HEAD since the stash's commit isn't overwritten
+  fs_force_rm_beargit_dir();
+  unlink("b");
+  unlink("c");
+  beargit_init();
+  write_string_to_file("a", "1");
+  beargit_add("a");
+  beargit_commit("THIS IS BEAR TERRITORY! 1");
+  beargit_checkout("side", 1);
+  write_string_to_file("a", "3");
+  beargit_commit("THIS IS BEAR TERRITORY! 3");
+  beargit_checkout("master", 0);
+  write_string_to_file("a", "2");
+  CU_ASSERT(0 == beargit_stash(NULL));
+  CU_ASSERT(0 == beargit_checkout("side", 0));
+  capture_clear(stderr);
+  CU_ASSERT(1 == beargit_stash("pop"));
+  CU_ASSERT(NULL != strstr(capture_get(stderr), "a changed since the stash was taken"));
+  read_string_from_file("a", contents, sizeof(contents));
+  CU_ASSERT_STRING_EQUAL(contents, "3");
+  CU_ASSERT(fs_check_dir_exists(".beargit/.stash/0"));
+}
+
 /* The main() function for setting up and running the tests.
  * Returns a CUE_SUCCESS on successful running, another
  * CUnit error code on failure.
@@ -627,6 +1840,12 @@ int cunittester()
     CU_pSuite checkout_test_0_commit = NULL;
     CU_pSuite reset_test_basic = NULL;
     CU_pSuite reset_test_errors = NULL;
+    //These suites group the tests of the later features by area
+    CU_pSuite object_storage_tests = NULL;
+    CU_pSuite working_tree_tests = NULL;
+    CU_pSuite history_tests = NULL;
+    CU_pSuite transfer_tests = NULL;
+    CU_pSuite tracing_tests = NULL;
 
     /* initialize the CUnit test registry */
     if (CUE_SUCCESS != CU_initialize_registry())
@@ -808,6 +2027,91 @@ int cunittester()
       return CU_get_error();
     }
 
+    object_storage_tests = CU_add_suite_with_setup_and_teardown("Object Storage Tests",
+        init_suite, clean_suite, init_test, NULL);
+    if (NULL == object_storage_tests)
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+    if (NULL == CU_add_test(object_storage_tests, "IO engine test", test_io_engines)
+        || NULL == CU_add_test(object_storage_tests, "Index arena test", test_index_arena)
+        || NULL == CU_add_test(object_storage_tests, "Chunked commit test", test_chunked_commit)
+        || NULL == CU_add_test(object_storage_tests, "Object cache invalidation test", test_object_cache)
+        || NULL == CU_add_test(object_storage_tests, "Flat to sharded migration test", test_migrate_objects)
+        || NULL == CU_add_test(object_storage_tests, "GC unreachable test", test_gc)
+        || NULL == CU_add_test(object_storage_tests, "Recreated branch test", test_branch_recreate))
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+
+    working_tree_tests = CU_add_suite_with_setup_and_teardown("Working Tree Tests",
+        init_suite, clean_suite, init_test, NULL);
+    if (NULL == working_tree_tests)
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+    if (NULL == CU_add_test(working_tree_tests, "Fsmonitor commit test", test_fsmonitor_commit)
+        || NULL == CU_add_test(working_tree_tests, "Sparse checkout test", test_sparse_checkout)
+        || NULL == CU_add_test(working_tree_tests, "Multi-file reset test", test_reset_many)
+        || NULL == CU_add_test(working_tree_tests, "Untracked files and recursive add test", test_ignore_untracked)
+        || NULL == CU_add_test(working_tree_tests, "Stash and pop test", test_stash))
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+
+    history_tests = CU_add_suite_with_setup_and_teardown("History Tests",
+        init_suite, clean_suite, init_test, NULL);
+    if (NULL == history_tests)
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+    if (NULL == CU_add_test(history_tests, "Rev-list bitmap test", test_rev_list_bitmaps)
+        || NULL == CU_add_test(history_tests, "Log grep test", test_log_grep)
+        || NULL == CU_add_test(history_tests, "Blame test", test_blame)
+        || NULL == CU_add_test(history_tests, "Log path filter test", test_log_paths)
+        || NULL == CU_add_test(history_tests, "Abbreviated commit id test", test_short_ids)
+        || NULL == CU_add_test(history_tests, "Changed-file manifest test", test_show_manifest))
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+
+    transfer_tests = CU_add_suite_with_setup_and_teardown("Transfer Tests",
+        init_suite, clean_suite, init_test, NULL);
+    if (NULL == transfer_tests)
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+    if (NULL == CU_add_test(transfer_tests, "Clone fetch push test", test_clone_fetch_push)
+        || NULL == CU_add_test(transfer_tests, "Bundle roundtrip test", test_bundle)
+        || NULL == CU_add_test(transfer_tests, "Tar archive test", test_archive)
+        || NULL == CU_add_test(transfer_tests, "Fast import test", test_fast_import)
+        || NULL == CU_add_test(transfer_tests, "Fast export round trip test", test_fast_export))
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+
+    tracing_tests = CU_add_suite_with_setup_and_teardown("Tracing Tests",
+        init_suite, clean_suite, init_test, NULL);
+    if (NULL == tracing_tests)
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+    if (NULL == CU_add_test(tracing_tests, "Trace counters test", test_trace_counters)
+        || NULL == CU_add_test(tracing_tests, "In-memory output capture test", test_output_capture))
+    {
+      CU_cleanup_registry();
+      return CU_get_error();
+    }
+
     /* Run all tests using the CUnit Basic interface */
     CU_basic_set_mode(CU_BRM_VERBOSE);
     CU_basic_run_tests();
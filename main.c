@@ -2,6 +2,8 @@
  * This file contains functionality to parse command line arguments. Do not modify!
  */
 
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -19,7 +21,7 @@ int check_initialized(void) {
 }
 
 int check_filename(const char* filename) {
-  if (strlen(filename) > FILENAME_SIZE-1 || strlen(filename) == 0)
+  if (strlen(filename) > PATH_MAX-1 || strlen(filename) == 0)
     return 0;
 
   if (filename[0] == '.')
@@ -32,6 +34,8 @@ int check_filename(const char* filename) {
 
 #ifndef TESTING
 int main(int argc, char **argv) {
+    trace_init();
+
     if (argc < 2) {
         fprintf(stderr, "Usage: %s <command> [<args>]\n", argv[0]);
         return 2;
@@ -48,6 +52,15 @@ int main(int argc, char **argv) {
 
       return beargit_init();
 
+    } else if (strcmp(argv[1], "clone") == 0) {
+
+      if (argc < 4) {
+        fprintf(stderr, "ERROR: Usage: clone <path> <directory>\n");
+        return 1;
+      }
+
+      return beargit_clone(argv[2], argv[3]);
+
     } else {
 
         if (!check_initialized()) {
@@ -57,6 +70,12 @@ int main(int argc, char **argv) {
 
         if (strcmp(argv[1], "add") == 0 || strcmp(argv[1], "rm") == 0) {
 
+          struct stat s;
+          if (strcmp(argv[1], "add") == 0 && argc > 2 && stat(argv[2], &s) == 0
+              && S_ISDIR(s.st_mode)) {
+            return beargit_add_tree(argv[2]);
+          }
+
           if (argc < 3 || !check_filename(argv[2])) {
             fprintf(stderr, "ERROR: No or invalid filename given\n");
             return 1;
@@ -83,21 +102,65 @@ int main(int argc, char **argv) {
           return beargit_commit(argv[3]);
 
         } else if (strcmp(argv[1], "status") == 0) {
+            if (argc > 2 && strcmp(argv[2], "-u") == 0)
+              return beargit_status_untracked();
             return beargit_status();
         } else if (strcmp(argv[1], "log") == 0) {
             int limit = INT_MAX;
-            if (argc > 2 && strcmp(argv[2], "-n") == 0){
-              if (argc == 3){
-                fprintf(stderr, "ERROR: No log limit specified!\n");
+            const char* grep = NULL;
+            const char* rev = NULL;
+            for (int i = 2; i < argc; i++) {
+              if (strcmp(argv[i], "-n") == 0){
+                if (i + 1 == argc){
+                  fprintf(stderr, "ERROR: No log limit specified!\n");
+                  return 1;
+                }
+                limit = atoi(argv[++i]);
+                if (limit < 0){
+                  fprintf(stderr, "ERROR: Illegal log limit specified!\n");
+                }
+              } else if (strcmp(argv[i], "--") == 0){
+                if (i + 1 == argc){
+                  fprintf(stderr, "ERROR: No paths specified!\n");
+                  return 1;
+                }
+                if (grep){
+                  fprintf(stderr, "ERROR: --grep can't be combined with paths!\n");
+                  return 1;
+                }
+                if (rev){
+                  fprintf(stderr, "ERROR: A revision can't be combined with paths!\n");
+                  return 1;
+                }
+                return beargit_log_paths((const char**) argv + i + 1, argc - i - 1, limit);
+              } else if (strcmp(argv[i], "--grep") == 0){
+                if (i + 1 == argc){
+                  fprintf(stderr, "ERROR: No grep pattern specified!\n");
+                  return 1;
+                }
+                grep = argv[++i];
+              } else if (rev == NULL){
+                rev = argv[i];
+              } else {
+                fprintf(stderr, "ERROR: Too many arguments for log!\n");
                 return 1;
               }
-              limit = atoi(argv[3]);
-              if (limit < 0){
-                fprintf(stderr, "ERROR: Illegal log limit specified!\n");
-              }
             }
-            return beargit_log(limit);
+            if (grep && rev){
+              fprintf(stderr, "ERROR: --grep can't be combined with a revision!\n");
+              return 1;
+            }
+            if (grep)
+              return beargit_log_grep(grep, limit);
+            return beargit_log_rev(rev, limit);
         } else if (strcmp(argv[1], "branch") == 0) {
+            if (argc > 2) {
+              if (strcmp(argv[2], "-d") != 0 || argc < 4) {
+                fprintf(stderr, "ERROR: Need to specify a branch to delete (-d <branch>)\n");
+                return 1;
+              }
+              return beargit_branch_delete(argv[3]);
+            }
             return beargit_branch();
         } else if (strcmp(argv[1], "checkout") == 0) {
             int branch_new = 0;
@@ -124,13 +187,13 @@ int main(int argc, char **argv) {
 
             return beargit_checkout(arg, branch_new);
         } else if (strcmp(argv[1], "reset") == 0) {
-             if (argc < 4) {
+             if (argc < 3) {
                   fprintf(stderr,
-                          "ERROR: Need to specify a commit id and a filename");
+                          "ERROR: Need to specify a commit id");
                   return 1;
              }
 
-             return beargit_reset(argv[2], argv[3]);
+             return beargit_reset_paths(argv[2], (const char**) argv + 3, argc - 3);
         } else if (strcmp(argv[1], "merge") == 0) {
              if (argc < 3) {
                   fprintf(stderr, "ERROR: Need to specify a commit id or branch name");
@@ -138,6 +201,117 @@ int main(int argc, char **argv) {
              }
 
              return beargit_merge(argv[2]);
+        } else if (strcmp(argv[1], "fsmonitor") == 0) {
+             if (argc < 3 || (strcmp(argv[2], "start") != 0 && strcmp(argv[2], "stop") != 0
+                              && strcmp(argv[2], "query") != 0)) {
+                  fprintf(stderr, "ERROR: Need to specify start, stop or query\n");
+                  return 1;
+             }
+
+             return beargit_fsmonitor(argv[2]);
+        } else if (strcmp(argv[1], "rev-list") == 0) {
+             int count_only = (argc > 2 && strcmp(argv[2], "--count") == 0);
+             if (argc < 3 + count_only) {
+                  fprintf(stderr, "ERROR: Need to specify a commit id or branch name\n");
+                  return 1;
+             }
+
+             return beargit_rev_list((const char**) argv + 2 + count_only,
+                                     argc - 2 - count_only, count_only);
+        } else if (strcmp(argv[1], "merge-base") == 0) {
+             if (argc < 5 || strcmp(argv[2], "--is-ancestor") != 0) {
+                  fprintf(stderr, "ERROR: Usage: merge-base --is-ancestor <rev1> <rev2>\n");
+                  return 1;
+             }
+
+             return beargit_is_ancestor(argv[3], argv[4]);
+        } else if (strcmp(argv[1], "fetch") == 0) {
+             return beargit_fetch(argc > 2 ? argv[2] : NULL);
+        } else if (strcmp(argv[1], "push") == 0) {
+             return beargit_push(argc > 2 ? argv[2] : NULL, argc > 3 ? argv[3] : NULL);
+        } else if (strcmp(argv[1], "bundle") == 0) {
+             if (argc < 4 || (strcmp(argv[2], "create") != 0 && strcmp(argv[2], "unbundle") != 0)) {
+                  fprintf(stderr, "ERROR: Usage: bundle create <file> [<rev>...] | bundle unbundle <file>\n");
+                  return 1;
+             }
+
+             return beargit_bundle(argv[2], argv[3], (const char**) argv + 4, argc - 4);
+        } else if (strcmp(argv[1], "sparse") == 0) {
+             if (argc < 3 || (strcmp(argv[2], "set") == 0 && argc < 4)) {
+                  fprintf(stderr, "ERROR: Usage: sparse set <pattern>... | sparse disable | sparse list\n");
+                  return 1;
+             }
+
+             return beargit_sparse(argv[2], (const char**) argv + 3, argc - 3);
+        } else if (strcmp(argv[1], "blame") == 0) {
+             if (argc < 3) {
+                  fprintf(stderr, "ERROR: Usage: blame <filename> [<rev>]\n");
+                  return 1;
+             }
+
+             return beargit_blame(argv[2], argc > 3 ? argv[3] : NULL);
+        } else if (strcmp(argv[1], "archive") == 0) {
+             const char* rev = NULL;
+             const char* format = NULL;
+             const char* output = NULL;
+             for (int i = 2; i < argc; i++) {
+                  if (strncmp(argv[i], "--format=", 9) == 0)
+                       format = argv[i] + 9;
+                  else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+                       output = argv[++i];
+                  else if (rev == NULL)
+                       rev = argv[i];
+                  else
+                       rev = "";
+             }
+             if (rev == NULL || rev[0] == '\0') {
+                  fprintf(stderr, "ERROR: Usage: archive <rev> [--format=tar] [-o <file>]\n");
+                  return 1;
+             }
+
+             return beargit_archive(rev, format, output);
+        } else if (strcmp(argv[1], "fast-import") == 0) {
+             if (argc > 3) {
+                  fprintf(stderr, "ERROR: Usage: fast-import [<file>]\n");
+                  return 1;
+             }
+             return beargit_fast_import(argc == 3 ? argv[2] : NULL);
+        } else if (strcmp(argv[1], "fast-export") == 0) {
+             if (argc != 2 && (argc != 4 || strcmp(argv[2], "-o") != 0)) {
+                  fprintf(stderr, "ERROR: Usage: fast-export [-o <file>]\n");
+                  return 1;
+             }
+             return beargit_fast_export(argc == 4 ? argv[3] : NULL);
+        } else if (strcmp(argv[1], "show") == 0) {
+             if (argc > 3) {
+                  fprintf(stderr, "ERROR: Usage: show [<rev>]\n");
+                  return 1;
+             }
+             return beargit_show(argc == 3 ? argv[2] : NULL);
+        } else if (strcmp(argv[1], "stash") == 0) {
+             if (argc > 3 || (argc == 3 && strcmp(argv[2], "pop") != 0
+                              && strcmp(argv[2], "list") != 0)) {
+                  fprintf(stderr, "ERROR: Usage: stash [pop|list]\n");
+                  return 1;
+             }
+             return beargit_stash(argc == 3 ? argv[2] : NULL);
+        } else if (strcmp(argv[1], "migrate-objects") == 0) {
+             if (argc != 2) {
+                  fprintf(stderr, "ERROR: Usage: migrate-objects\n");
+                  return 1;
+             }
+             return beargit_migrate_objects();
+        } else if (strcmp(argv[1], "gc") == 0) {
+             const char* grace = NULL;
+             if (argc > 2) {
+                  if (strcmp(argv[2], "--grace") != 0 || argc < 4) {
+                       fprintf(stderr, "ERROR: Usage: gc [--grace <age>]\n");
+                       return 1;
+                  }
+                  grace = argv[3];
+             }
+
+             return beargit_gc(grace);
         } else {
             fprintf(stderr, "ERROR: Unknown command \"%s\"\n", argv[1]);
             return 1;
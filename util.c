@@ -1,22 +1,57 @@
+#define _DEFAULT_SOURCE
+
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include "util.h"
-const char * file_stdout = "TEST_STDOUT";
-const char * file_stderr = "TEST_STDERR";
 
 void fs_mkdir(const char* dirname) {
   ASSERT_ERROR_MESSAGE(dirname != NULL, "dirname is not a valid string");
   ASSERT_ERROR_MESSAGE(is_sane_path(dirname), "dirname is not a valid path within .beargit");
+  TRACE_BEGIN(span, "fs_mkdir");
   int ret = mkdir(dirname, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  TRACE_END(span);
+  TRACE_COUNT(TRACE_DIRS_CREATED, 1);
+  TRACE_COUNT(TRACE_SYSCALLS, 1);
   ASSERT_ERROR_MESSAGE(ret == 0, "creating directory failed");
 }
 
+// Creates the missing directories leading up to <path> (but not <path> itself).
+void fs_mkdir_parents(const char* path) {
+  const char* slash = strrchr(path, '/');
+  if (slash == NULL)
+    return;
+  char* dir = strndup(path, slash - path);
+  struct stat s;
+  if (stat(dir, &s) != 0) {
+    for (char* p = strchr(dir + 1, '/'); ; p = strchr(p + 1, '/')) {
+      if (p)
+        *p = '\0';
+      int ret = mkdir(dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+      TRACE_COUNT(TRACE_SYSCALLS, 1);
+      ASSERT_ERROR_MESSAGE(ret == 0 || errno == EEXIST, "creating directory failed");
+      if (ret == 0)
+        TRACE_COUNT(TRACE_DIRS_CREATED, 1);
+      if (p == NULL)
+        break;
+      *p = '/';
+    }
+  }
+  free(dir);
+}
+
 void fs_rm(const char* filename) {
   ASSERT_ERROR_MESSAGE(filename != NULL, "filename is not a valid string");
   ASSERT_ERROR_MESSAGE(is_sane_path(filename), "filename is not a valid path within .beargit");
   int ret = unlink(filename);
+  TRACE_COUNT(TRACE_SYSCALLS, 1);
   ASSERT_ERROR_MESSAGE(ret == 0, "deleting/unlinking file failed");
 }
 
@@ -24,6 +59,7 @@ void fs_force_rm_beargit_dir() {
   // BAD HACK. Don't use this in real-world code.
   // This removes the .beargit directory and directs all output to /dev/null
   system("rm -rf .beargit");
+  object_cache_clear();
 }
 
 void fs_mv(const char* src, const char* dst) {
@@ -32,14 +68,17 @@ void fs_mv(const char* src, const char* dst) {
   ASSERT_ERROR_MESSAGE(is_sane_path(src), "src is not a valid path within .beargit");
   ASSERT_ERROR_MESSAGE(is_sane_path(dst), "dst is not a valid path within .beargit");
   int ret = rename(src, dst);
+  TRACE_COUNT(TRACE_SYSCALLS, 1);
   ASSERT_ERROR_MESSAGE(ret == 0, "renaming file failed");
 }
 
-void fs_cp(const char* src, const char* dst) {
+// Copies <src> to <dst>, feeding the bytes to <sha> too unless it is NULL.
+static void copy_file(const char* src, const char* dst, SHA_CTX* sha) {
   ASSERT_ERROR_MESSAGE(src != NULL, "src is not a valid string");
   ASSERT_ERROR_MESSAGE(dst != NULL, "dst is not a valid string");
   ASSERT_ERROR_MESSAGE(is_sane_path(dst), "dst is not a valid path within .beargit");
 
+  TRACE_BEGIN(span, "fs_cp");
   FILE* fin = fopen(src, "r");
   ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open source file");
   FILE* fout = fopen(dst, "w");
@@ -47,13 +86,28 @@ void fs_cp(const char* src, const char* dst) {
 
   char buffer[4096];
   int size;
+  long total = 0;
+  int chunks = 0;
 
   while ((size = fread(buffer, 1, 4096, fin)) > 0) {
     fwrite(buffer, 1, size, fout);
+    if (sha)
+      SHA1_Update(sha, buffer, size);
+    total += size;
+    chunks++;
   }
 
   fclose(fin);
   fclose(fout);
+  TRACE_END(span);
+  TRACE_COUNT(TRACE_FILES_COPIED, 1);
+  TRACE_COUNT(TRACE_BYTES_MOVED, total);
+  // open + close for both files, one read/write pair per chunk, final empty read
+  TRACE_COUNT(TRACE_SYSCALLS, 5 + 2 * chunks);
+}
+
+void fs_cp(const char* src, const char* dst) {
+  copy_file(src, dst, NULL);
 }
 
 void write_string_to_file(const char* filename, const char* str) {
@@ -61,13 +115,25 @@ void write_string_to_file(const char* filename, const char* str) {
   ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't open file");
   fwrite(str, 1, strlen(str)+1, fout);
   fclose(fout);
+  TRACE_COUNT(TRACE_BYTES_MOVED, strlen(str)+1);
+  TRACE_COUNT(TRACE_SYSCALLS, 3);
 }
 
 void read_string_from_file(const char* filename, char* str, int size) {
+  if (is_object_path(filename)) {
+    size_t length;
+    char* data = object_read(filename, &length);
+    ASSERT_ERROR_MESSAGE(data != NULL, "couldn't open file");
+    memcpy(str, data, length < (size_t) size ? length : (size_t) size);
+    free(data);
+    return;
+  }
   FILE* fin = fopen(filename, "r");
   ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open file");
-  fread(str, 1, size, fin);
+  size_t nread = fread(str, 1, size, fin);
   fclose(fin);
+  TRACE_COUNT(TRACE_BYTES_MOVED, nread);
+  TRACE_COUNT(TRACE_SYSCALLS, 3);
 }
 
 int fs_check_dir_exists(const char* dirname) {
@@ -76,49 +142,435 @@ int fs_check_dir_exists(const char* dirname) {
   return !(ret_code == -1 || !(S_ISDIR(s.st_mode)));
 }
 
+// Hard-links <src> to <dst>. Returns 0 on success; on failure nothing is
+// created and the caller is expected to fall back to fs_cp.
+int fs_link(const char* src, const char* dst) {
+  ASSERT_ERROR_MESSAGE(is_sane_path(dst), "dst is not a valid path within .beargit");
+  int ret = link(src, dst);
+  TRACE_COUNT(TRACE_SYSCALLS, 1);
+  return ret == 0 ? 0 : 1;
+}
+
+/* Content-defined chunking */
+
+static const char chunk_magic[16] = "\0beargit-chunks\n";
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+static int tmp_counter = 0;
+
+static void init_gear(void) {
+  // splitmix64, so every repository agrees on the table
+  uint64_t x = 0x6265617267697421ULL;
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+static void sha1_to_hex(const unsigned char* digest, char* hex) {
+  for (int i = 0; i < SHA_DIGEST_LENGTH; ++i)
+    sprintf(&hex[i*2], "%02x", digest[i]);
+  hex[SHA_HEX_BYTES] = '\0';
+}
+
+void chunk_path(const char* hash, char* path) {
+  sprintf(path, "%s/%.2s/%s", CHUNK_DIR, hash, hash + 2);
+}
+
+// Writes <data> as a chunk unless a chunk with the same hash already exists.
+void chunk_store(const unsigned char* data, size_t len, char* hash) {
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  SHA1(data, len, digest);
+  sha1_to_hex(digest, hash);
+  TRACE_COUNT(TRACE_HASHES, 1);
+
+  char path[CHUNK_PATH_SIZE];
+  chunk_path(hash, path);
+  // Refresh the mtime of a chunk we reuse so a concurrent gc, which only
+  // sweeps chunks older than its grace period, leaves it alone.
+  if (utimensat(AT_FDCWD, path, NULL, 0) == 0)
+    return;
+
+  char dir[CHUNK_PATH_SIZE];
+  sprintf(dir, "%s/%.2s", CHUNK_DIR, hash);
+  // Other copy workers may be creating the same directories.
+  if (mkdir(CHUNK_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
+    ASSERT_ERROR_MESSAGE(errno == EEXIST, "creating chunk directory failed");
+  if (mkdir(dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
+    ASSERT_ERROR_MESSAGE(errno == EEXIST, "creating chunk directory failed");
+
+  // Write under a temporary name first so readers never see half a chunk.
+  char tmp[CHUNK_PATH_SIZE];
+  int written = snprintf(tmp, sizeof(tmp), "%s.tmp%d.%d", path, (int) getpid(),
+                         __atomic_fetch_add(&tmp_counter, 1, __ATOMIC_RELAXED));
+  ASSERT_ERROR_MESSAGE(written > 0 && (size_t) written < sizeof(tmp), "chunk path too long");
+  FILE* fout = fopen(tmp, "w");
+  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't create chunk");
+  fwrite(data, 1, len, fout);
+  fclose(fout);
+  fs_mv(tmp, path);
+  TRACE_COUNT(TRACE_BYTES_MOVED, len);
+  TRACE_COUNT(TRACE_SYSCALLS, 5);
+}
+
+static void snapshot_chunked(const char* src, const char* dst, SHA_CTX* sha) {
+  TRACE_BEGIN(span, "fs_snapshot_chunked");
+  static const uint64_t mask_small = ((1ULL << (CHUNK_AVG_BITS + 2)) - 1) << (64 - CHUNK_AVG_BITS - 2);
+  static const uint64_t mask_large = ((1ULL << (CHUNK_AVG_BITS - 2)) - 1) << (64 - CHUNK_AVG_BITS + 2);
+  pthread_once(&gear_once, init_gear);
+
+  FILE* fin = fopen(src, "r");
+  ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open source file");
+  FILE* fout = fopen(dst, "w");
+  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't open destination file");
+
+  fseek(fin, 0, SEEK_END);
+  long total = ftell(fin);
+  fseek(fin, 0, SEEK_SET);
+  fwrite(chunk_magic, 1, sizeof(chunk_magic), fout);
+  fprintf(fout, "%ld\n", total);
+
+  unsigned char* chunk = malloc(CHUNK_MAX_SIZE);
+  unsigned char buffer[64 << 10];
+  size_t len = 0, size;
+  uint64_t hash = 0;
+  char chunk_hash[SHA_HEX_BYTES + 1];
+
+  while ((size = fread(buffer, 1, sizeof(buffer), fin)) > 0) {
+    if (sha)
+      SHA1_Update(sha, buffer, size);
+    for (size_t i = 0; i < size; i++) {
+      chunk[len++] = buffer[i];
+      hash = (hash << 1) + gear[buffer[i]];
+
+      // Normalized chunking: a harder cut condition below the average size
+      // and an easier one above it keeps chunk sizes close to the average.
+      int cut;
+      if (len < CHUNK_MIN_SIZE)
+        cut = 0;
+      else if (len < (1 << CHUNK_AVG_BITS))
+        cut = (hash & mask_small) == 0;
+      else
+        cut = (hash & mask_large) == 0 || len == CHUNK_MAX_SIZE;
+
+      if (cut) {
+        chunk_store(chunk, len, chunk_hash);
+        fprintf(fout, "%s %zu\n", chunk_hash, len);
+        len = 0;
+        hash = 0;
+      }
+    }
+  }
+  if (len > 0) {
+    chunk_store(chunk, len, chunk_hash);
+    fprintf(fout, "%s %zu\n", chunk_hash, len);
+  }
+
+  free(chunk);
+  fclose(fin);
+  fclose(fout);
+  TRACE_END(span);
+}
+
+void fs_snapshot_chunked(const char* src, const char* dst) {
+  snapshot_chunked(src, dst, NULL);
+}
+
+int fs_is_chunk_list(const char* filename) {
+  char magic[sizeof(chunk_magic)];
+  FILE* fin = fopen(filename, "r");
+  if (fin == NULL)
+    return 0;
+  size_t size = fread(magic, 1, sizeof(magic), fin);
+  fclose(fin);
+  return size == sizeof(magic) && memcmp(magic, chunk_magic, sizeof(magic)) == 0;
+}
+
+void fs_snapshot(const char* src, const char* dst) {
+  fs_snapshot_digest(src, dst, NULL);
+}
+
+void fs_snapshot_digest(const char* src, const char* dst, char* digest) {
+  SHA_CTX sha;
+  SHA1_Init(&sha);
+  SHA_CTX* ctx = digest ? &sha : NULL;
+  struct stat s;
+  if (stat(src, &s) == 0 && s.st_size >= CHUNK_THRESHOLD)
+    snapshot_chunked(src, dst, ctx);
+  else
+    copy_file(src, dst, ctx);
+  if (digest) {
+    unsigned char md[SHA_DIGEST_LENGTH];
+    SHA1_Final(md, &sha);
+    sha1_to_hex(md, digest);
+    TRACE_COUNT(TRACE_HASHES, 1);
+  }
+}
+
+void fs_restore(const char* src, const char* dst) {
+  if (!fs_is_chunk_list(src)) {
+    fs_cp(src, dst);
+    return;
+  }
+
+  TRACE_BEGIN(span, "fs_restore");
+  FILE* fout = fopen(dst, "w");
+  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't open destination file");
+  fs_restore_stream(src, fout);
+  fclose(fout);
+  TRACE_END(span);
+  TRACE_COUNT(TRACE_FILES_COPIED, 1);
+}
+
+// Writes the contents of the snapshot file <src> to <out>, reassembling it if
+// it is a chunk list.
+void fs_restore_stream(const char* src, FILE* out) {
+  if (is_object_path(src)) {
+    size_t size;
+    char* data = object_read(src, &size);
+    ASSERT_ERROR_MESSAGE(data != NULL, "couldn't open source file");
+    if (size < sizeof(chunk_magic) || memcmp(data, chunk_magic, sizeof(chunk_magic)) != 0) {
+      fwrite(data, 1, size, out);
+      free(data);
+      return;
+    }
+    free(data);
+  }
+  FILE* fin = fopen(src, "r");
+  ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open source file");
+  char buffer[64 << 10];
+  size_t size;
+  if (!fs_is_chunk_list(src)) {
+    while ((size = fread(buffer, 1, sizeof(buffer), fin)) > 0)
+      fwrite(buffer, 1, size, out);
+    fclose(fin);
+    return;
+  }
+
+  fseek(fin, sizeof(chunk_magic), SEEK_SET);
+  long total;
+  ASSERT_ERROR_MESSAGE(fscanf(fin, "%ld\n", &total) == 1, "corrupt chunk list");
+
+  char hash[SHA_HEX_BYTES + 1];
+  size_t len;
+  while (fscanf(fin, "%40s %zu\n", hash, &len) == 2) {
+    char path[CHUNK_PATH_SIZE];
+    chunk_path(hash, path);
+    FILE* fchunk = fopen(path, "r");
+    ASSERT_ERROR_MESSAGE(fchunk != NULL, "missing chunk");
+    while ((size = fread(buffer, 1, sizeof(buffer), fchunk)) > 0) {
+      fwrite(buffer, 1, size, out);
+      total -= size;
+      TRACE_COUNT(TRACE_BYTES_MOVED, size);
+    }
+    fclose(fchunk);
+  }
+  ASSERT_ERROR_MESSAGE(total == 0, "chunked file has the wrong size");
+  fclose(fin);
+}
+
+// Whether the next <len> bytes of <a> and <b> are equal.
+static int streams_match(FILE* a, FILE* b, size_t len) {
+  char buf_a[16 << 10], buf_b[16 << 10];
+  while (len > 0) {
+    size_t want = len < sizeof(buf_a) ? len : sizeof(buf_a);
+    if (fread(buf_a, 1, want, a) != want || fread(buf_b, 1, want, b) != want
+        || memcmp(buf_a, buf_b, want) != 0)
+      return 0;
+    len -= want;
+    TRACE_COUNT(TRACE_BYTES_MOVED, 2 * want);
+  }
+  return 1;
+}
+
+int fs_snapshot_matches(const char* snapshot, const char* path) {
+  struct stat s;
+  if (stat(path, &s) != 0 || fs_snapshot_size(snapshot) != s.st_size)
+    return 0;
+  FILE* fsnapshot = fopen(snapshot, "r");
+  FILE* fin = fopen(path, "r");
+  int same = fsnapshot != NULL && fin != NULL;
+  if (same && !fs_is_chunk_list(snapshot)) {
+    same = streams_match(fsnapshot, fin, s.st_size);
+  } else if (same) {
+    fseek(fsnapshot, sizeof(chunk_magic), SEEK_SET);
+    long total;
+    ASSERT_ERROR_MESSAGE(fscanf(fsnapshot, "%ld\n", &total) == 1, "corrupt chunk list");
+    char hash[SHA_HEX_BYTES + 1];
+    size_t len;
+    while (same && fscanf(fsnapshot, "%40s %zu\n", hash, &len) == 2) {
+      char chunk[CHUNK_PATH_SIZE];
+      chunk_path(hash, chunk);
+      FILE* fchunk = fopen(chunk, "r");
+      ASSERT_ERROR_MESSAGE(fchunk != NULL, "missing chunk");
+      same = streams_match(fchunk, fin, len);
+      fclose(fchunk);
+    }
+  }
+  if (fsnapshot)
+    fclose(fsnapshot);
+  if (fin)
+    fclose(fin);
+  return same;
+}
+
+// Returns the size of the file the snapshot <src> restores to.
+long long fs_snapshot_size(const char* src) {
+  if (fs_is_chunk_list(src)) {
+    FILE* fin = fopen(src, "r");
+    ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open chunk list");
+    fseek(fin, sizeof(chunk_magic), SEEK_SET);
+    long total;
+    ASSERT_ERROR_MESSAGE(fscanf(fin, "%ld\n", &total) == 1, "corrupt chunk list");
+    fclose(fin);
+    return total;
+  }
+  struct stat s;
+  ASSERT_ERROR_MESSAGE(stat(src, &s) == 0, "couldn't stat snapshot");
+  return s.st_size;
+}
+
+// Adds the hash of every chunk the chunk list <filename> refers to to <hashes>.
+void chunk_list_hashes(const char* filename, struct strset* hashes) {
+  FILE* fin = fopen(filename, "r");
+  ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open chunk list");
+  fseek(fin, sizeof(chunk_magic), SEEK_SET);
+  long total;
+  ASSERT_ERROR_MESSAGE(fscanf(fin, "%ld\n", &total) == 1, "corrupt chunk list");
+  char hash[SHA_HEX_BYTES + 1];
+  size_t len;
+  while (fscanf(fin, "%40s %zu\n", hash, &len) == 2)
+    strset_add(hashes, hash);
+  fclose(fin);
+}
+
+// Removes the directory <dirname> and everything below it. Returns the number
+// of bytes freed.
+long long fs_rm_tree(const char* dirname) {
+  ASSERT_ERROR_MESSAGE(is_sane_path(dirname), "dirname is not a valid path within .beargit");
+  DIR* dir = opendir(dirname);
+  ASSERT_ERROR_MESSAGE(dir != NULL, "couldn't open directory");
+  long long freed = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    char* child = malloc(strlen(dirname) + strlen(entry->d_name) + 2);
+    sprintf(child, "%s/%s", dirname, entry->d_name);
+    struct stat s;
+    ASSERT_ERROR_MESSAGE(lstat(child, &s) == 0, "couldn't stat file");
+    if (S_ISDIR(s.st_mode)) {
+      freed += fs_rm_tree(child);
+    } else {
+      // Hard-linked snapshot files only free space with their last link.
+      if (s.st_nlink == 1)
+        freed += s.st_size;
+      ASSERT_ERROR_MESSAGE(unlink(child) == 0, "deleting/unlinking file failed");
+    }
+    free(child);
+    TRACE_COUNT(TRACE_SYSCALLS, 2);
+  }
+  closedir(dir);
+  ASSERT_ERROR_MESSAGE(rmdir(dirname) == 0, "removing directory failed");
+  TRACE_COUNT(TRACE_SYSCALLS, 3);
+  return freed;
+}
+
+/* Output capture for the unit tests: everything the fakes print to stdout
+ * or stderr is appended to a growable in-memory buffer per stream. */
+
+struct capture {
+    char* data;
+    size_t size;
+    size_t capacity;
+};
+
+static struct capture captured[2];
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct capture* capture_of(FILE* stream) {
+    if (stream == stdout)
+        return &captured[0];
+    if (stream == stderr)
+        return &captured[1];
+    return NULL;
+}
+
+static void capture_vprintf(struct capture* capture, const char* fmt, va_list args) {
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(NULL, 0, fmt, copy);
+    va_end(copy);
+    if (len < 0)
+        return;
+    pthread_mutex_lock(&capture_lock);
+    if (capture->size + len + 1 > capture->capacity) {
+        size_t capacity = capture->capacity ? capture->capacity : 4096;
+        while (capture->size + len + 1 > capacity)
+            capacity *= 2;
+        capture->data = realloc(capture->data, capacity);
+        ASSERT_ERROR_MESSAGE(capture->data != NULL, "out of memory");
+        capture->capacity = capacity;
+    }
+    vsnprintf(capture->data + capture->size, len + 1, fmt, args);
+    capture->size += len;
+    pthread_mutex_unlock(&capture_lock);
+}
+
+// Returns everything captured from <stream> (stdout or stderr) since it was
+// last cleared. The text stays valid until the next print to <stream>.
+const char* capture_get(FILE* stream) {
+    struct capture* capture = capture_of(stream);
+    return capture && capture->size ? capture->data : "";
+}
+
+// Opens the text captured from <stream> for reading with stdio.
+FILE* capture_open(FILE* stream) {
+    struct capture* capture = capture_of(stream);
+    pthread_mutex_lock(&capture_lock);
+    size_t size = capture ? capture->size : 0;
+    // fmemopen keeps the last byte of its buffer for a terminating NUL
+    FILE* fin = size ? fmemopen(NULL, size + 1, "w+") : fopen("/dev/null", "r");
+    if (fin && size) {
+        fwrite(capture->data, 1, size, fin);
+        rewind(fin);
+    }
+    pthread_mutex_unlock(&capture_lock);
+    return fin;
+}
+
+void capture_clear(FILE* stream) {
+    struct capture* capture = capture_of(stream);
+    pthread_mutex_lock(&capture_lock);
+    if (capture)
+        capture->size = 0;
+    pthread_mutex_unlock(&capture_lock);
+}
+
 int fake_print(char* fmt, ...) {
-    // append to file
-    char data[2048]; // if your line is longer than this, you're doing something wrong
     va_list args;
     va_start(args, fmt);
-    vsprintf(data, fmt, args);
+    capture_vprintf(&captured[0], fmt, args);
     va_end(args);
-    FILE *fp = fopen(file_stdout, "a");
-    if (fp != NULL) {
-        fputs(data, fp);
-        fclose(fp);
-    }
     return 0;
 }
 
 int fake_fprint(FILE* stream, char* fmt, ...) {
-    // append to file
-    char data[2048]; // if your line is longer than this, you're doing something wrong
     va_list args;
-    const char * filename_to_open;
-    if (stream == stdout) {
-        filename_to_open = file_stdout;
-    } else if (stream == stderr) {
-        filename_to_open = file_stderr;
-    } else {
-        va_start(args, fmt);
-        vfprintf(stream, fmt, args);
-        va_end(args);
-        return 0;
-    }
     va_start(args, fmt);
-    vsprintf(data, fmt, args);
+    struct capture* capture = capture_of(stream);
+    if (capture)
+        capture_vprintf(capture, fmt, args);
+    else
+        vfprintf(stream, fmt, args);
     va_end(args);
-    FILE *fp = fopen(filename_to_open, "a");
-    if (fp != NULL) {
-        fputs(data, fp);
-        fclose(fp);
-    }
     return 0;
 }
 
 int is_sane_path(const char* path) {
-  if (strlen(path) > 512)
+  if (strlen(path) >= PATH_MAX)
     return 0;
 
   // Only allow modifying files in .beargit directory
@@ -131,9 +583,1581 @@ int is_sane_path(const char* path) {
 
 void cryptohash(const char* str, char dst[SHA_HEX_BYTES + 1]) {
      char buf[SHA_DIGEST_LENGTH];
+     TRACE_COUNT(TRACE_HASHES, 1);
      SHA1((unsigned char*)str, strlen(str), (unsigned char*) buf);
      for (size_t i = 0; i < SHA_DIGEST_LENGTH; ++i) {
           sprintf(&dst[i*2], "%02x", (unsigned char)buf[i]);
      }
      dst[SHA_HEX_BYTES] = '\0';
 }
+
+/* Arenas */
+
+void arena_init(struct arena* arena) {
+  arena->blocks = NULL;
+  arena->interned = NULL;
+}
+
+void* arena_alloc(struct arena* arena, size_t size) {
+  size = (size + 15) & ~(size_t) 15;
+  struct arena_block* block = arena->blocks;
+  if (block == NULL || block->used + size > block->size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(struct arena_block) + block_size);
+    ASSERT_ERROR_MESSAGE(block != NULL, "out of memory");
+    block->used = 0;
+    block->size = block_size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+  void* ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+char* arena_strdup(struct arena* arena, const char* str) {
+  size_t len = strlen(str) + 1;
+  char* copy = arena_alloc(arena, len);
+  memcpy(copy, str, len);
+  return copy;
+}
+
+char* arena_printf(struct arena* arena, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+
+  char* str = arena_alloc(arena, len + 1);
+  va_start(args, fmt);
+  vsnprintf(str, len + 1, fmt, args);
+  va_end(args);
+  return str;
+}
+
+// Returns the arena's copy of <str>, making one on first use.
+const char* arena_intern(struct arena* arena, const char* str) {
+  if (arena->interned == NULL)
+    arena->interned = strset_new_in(arena);
+  strset_add(arena->interned, str);
+  return strset_get(arena->interned, str);
+}
+
+void arena_free(struct arena* arena) {
+  strset_free(arena->interned);
+  while (arena->blocks) {
+    struct arena_block* next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
+  }
+  arena->interned = NULL;
+}
+
+/* String sets */
+
+static unsigned int strset_hash(const char* str) {
+  unsigned int h = 2166136261u;
+  while (*str) {
+    h ^= (unsigned char) *str++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+struct strset* strset_new_in(struct arena* arena) {
+  struct strset* set = malloc(sizeof(struct strset));
+  set->capacity = 64;
+  set->count = 0;
+  set->slots = calloc(set->capacity, sizeof(char*));
+  set->values = NULL;
+  set->arena = arena;
+  return set;
+}
+
+struct strset* strset_new(void) {
+  return strset_new_in(NULL);
+}
+
+static void strset_grow(struct strset* set) {
+  char** old_slots = set->slots;
+  const void** old_values = set->values;
+  int old_capacity = set->capacity;
+
+  set->capacity *= 2;
+  set->slots = calloc(set->capacity, sizeof(char*));
+  if (old_values)
+    set->values = calloc(set->capacity, sizeof(void*));
+  for (int i = 0; i < old_capacity; i++) {
+    if (old_slots[i] == NULL)
+      continue;
+    unsigned int j = strset_hash(old_slots[i]) & (set->capacity - 1);
+    while (set->slots[j])
+      j = (j + 1) & (set->capacity - 1);
+    set->slots[j] = old_slots[i];
+    if (old_values)
+      set->values[j] = old_values[i];
+  }
+  free(old_slots);
+  free(old_values);
+}
+
+static int strset_slot(const struct strset* set, const char* str) {
+  unsigned int i = strset_hash(str) & (set->capacity - 1);
+  while (set->slots[i] && strcmp(set->slots[i], str) != 0)
+    i = (i + 1) & (set->capacity - 1);
+  return i;
+}
+
+// Returns 1 if <str> was added, 0 if it was already in the set.
+int strset_add(struct strset* set, const char* str) {
+  if (2 * (set->count + 1) > set->capacity)
+    strset_grow(set);
+
+  int i = strset_slot(set, str);
+  if (set->slots[i])
+    return 0;
+  set->slots[i] = set->arena ? arena_strdup(set->arena, str) : strdup(str);
+  set->count++;
+  return 1;
+}
+
+// Returns the set's own copy of <str>, or NULL if it isn't in the set.
+const char* strset_get(const struct strset* set, const char* str) {
+  return set->slots[strset_slot(set, str)];
+}
+
+int strset_contains(const struct strset* set, const char* str) {
+  return strset_get(set, str) != NULL;
+}
+
+// Adds <str> if needed and sets its value to <value>.
+void strset_put(struct strset* set, const char* str, const void* value) {
+  strset_add(set, str);
+  if (set->values == NULL)
+    set->values = calloc(set->capacity, sizeof(void*));
+  set->values[strset_slot(set, str)] = value;
+}
+
+// Returns the value of <str>, or NULL if it has none.
+const void* strset_value(const struct strset* set, const char* str) {
+  if (set->values == NULL)
+    return NULL;
+  return set->values[strset_slot(set, str)];
+}
+
+void strset_free(struct strset* set) {
+  if (set == NULL)
+    return;
+  if (set->arena == NULL) {
+    for (int i = 0; i < set->capacity; i++)
+      free(set->slots[i]);
+  }
+  free(set->slots);
+  free(set->values);
+  free(set);
+}
+
+/* Batched copies */
+
+void copy_batch_init(struct copy_batch* batch) {
+  batch->jobs = NULL;
+  batch->count = 0;
+  batch->capacity = 0;
+  batch->made_dir = NULL;
+}
+
+void copy_batch_add(struct arena* arena, struct copy_batch* batch, const char* src,
+                    const char* dst, enum copy_kind kind) {
+  if (batch->count == batch->capacity) {
+    int capacity = batch->capacity ? 2 * batch->capacity : 64;
+    struct copy_job* jobs = arena_alloc(arena, capacity * sizeof(struct copy_job));
+    if (batch->count)
+      memcpy(jobs, batch->jobs, batch->count * sizeof(struct copy_job));
+    batch->jobs = jobs;
+    batch->capacity = capacity;
+  }
+  // Files in subdirectories need them to exist before the batch runs. Jobs
+  // usually come grouped by directory, so remember the last one made.
+  const char* slash = strrchr(dst, '/');
+  if (slash) {
+    size_t len = slash - dst;
+    if (batch->made_dir == NULL || strlen(batch->made_dir) != len
+        || strncmp(batch->made_dir, dst, len) != 0) {
+      fs_mkdir_parents(dst);
+      batch->made_dir = arena_printf(arena, "%.*s", (int) len, dst);
+    }
+  }
+
+  struct copy_job* job = &batch->jobs[batch->count++];
+  job->src = src;
+  job->dst = dst;
+  job->kind = kind;
+  job->digest[0] = '\0';
+}
+
+static void copy_job_run(struct copy_job* job) {
+  if (job->kind == COPY_SNAPSHOT)
+    fs_snapshot_digest(job->src, job->dst, job->digest);
+  else if (job->kind == COPY_RESTORE)
+    fs_restore(job->src, job->dst);
+  else
+    fs_cp(job->src, job->dst);
+}
+
+struct copy_pool {
+  struct copy_job** jobs;
+  int count;
+  int next;
+};
+
+static void* copy_worker(void* arg) {
+  struct copy_pool* pool = arg;
+  int i;
+  while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count)
+    copy_job_run(pool->jobs[i]);
+  return NULL;
+}
+
+// Runs <jobs> on a pool of worker threads.
+static void copy_jobs_threaded(struct copy_job** jobs, int count) {
+  if (count == 0)
+    return;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_threads = cpus < 1 ? 1 : cpus > COPY_MAX_THREADS ? COPY_MAX_THREADS : cpus;
+  if (num_threads > count)
+    num_threads = count;
+
+  struct copy_pool pool = { jobs, count, 0 };
+  pthread_t threads[COPY_MAX_THREADS];
+  int started = 0;
+  for (int i = 1; i < num_threads; i++) {
+    if (pthread_create(&threads[started], NULL, copy_worker, &pool) == 0)
+      started++;
+  }
+  copy_worker(&pool);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+}
+
+#ifdef __linux__
+#if defined(__has_include) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+  unsigned entries;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  unsigned pending;
+};
+
+// Unmaps whatever uring_init managed to map and closes the ring.
+static void uring_exit(struct uring* ring) {
+  if (ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+  if (ring->cq_ring != ring->sq_ring && ring->cq_ring != MAP_FAILED)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+static struct io_uring_sqe* uring_sqe(struct uring* ring, int opcode, uint64_t user_data) {
+  unsigned tail = *ring->sq_tail + ring->pending;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  ring->pending++;
+  return sqe;
+}
+
+// Submits all queued entries, waits for all of them and passes every
+// completion to <complete>.
+static int uring_run(struct uring* ring, void (*complete)(void*, uint64_t, int), void* arg) {
+  unsigned submitted = ring->pending;
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->pending, __ATOMIC_RELEASE);
+  ring->pending = 0;
+
+  unsigned to_submit = submitted;
+  unsigned done = 0;
+  while (done < submitted) {
+    int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, submitted - done,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    TRACE_COUNT(TRACE_SYSCALLS, 1);
+    if (ret < 0 && errno != EINTR)
+      return 1;
+    if (ret > 0)
+      to_submit -= (unsigned) ret < to_submit ? (unsigned) ret : to_submit;
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      complete(arg, cqe->user_data, cqe->res);
+      head++;
+      done++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+static void uring_probe_complete(void* arg, uint64_t user_data, int res) {
+  (void) user_data;
+  *(int*) arg = res;
+}
+
+static int uring_init(struct uring* ring, unsigned entries, int num_files) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    return 1;
+
+  ring->entries = params.sq_entries;
+  ring->pending = 0;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && ring->cq_ring_size > ring->sq_ring_size)
+    ring->sq_ring_size = ring->cq_ring_size;
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = single_mmap ? ring->sq_ring
+                  : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                    IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    uring_exit(ring);
+    return 1;
+  }
+
+  char* sq = ring->sq_ring;
+  char* cq = ring->cq_ring;
+  ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+  ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+  // A sparse table of direct descriptors; opens install files into it, so
+  // reads and writes linked behind an open know which file to use.
+  int fds[COPY_WINDOW];
+  for (int i = 0; i < num_files; i++)
+    fds[i] = -1;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, num_files) < 0) {
+    uring_exit(ring);
+    return 1;
+  }
+
+  // Opening into the table needs Linux 5.15; older kernels ignore file_index
+  // and return a real descriptor, which the linked closes would never see. A
+  // test open tells them apart before any job relies on it.
+  int res = -1;
+  struct io_uring_sqe* sqe = uring_sqe(ring, IORING_OP_OPENAT, 0);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t) "/dev/null";
+  sqe->open_flags = O_RDONLY;
+  sqe->file_index = 1;
+  if (uring_run(ring, uring_probe_complete, &res) != 0 || res != 0) {
+    if (res > 0)
+      close(res);
+    uring_exit(ring);
+    return 1;
+  }
+  sqe = uring_sqe(ring, IORING_OP_CLOSE, 0);
+  sqe->file_index = 1;
+  if (uring_run(ring, uring_probe_complete, &res) != 0) {
+    uring_exit(ring);
+    return 1;
+  }
+  return 0;
+}
+
+
+struct uring_file {
+  struct copy_job* job;
+  char* data;
+  size_t size;
+  int failed;
+};
+
+static void uring_complete(void* arg, uint64_t user_data, int res) {
+  struct uring_file* files = arg;
+  struct uring_file* file = &files[user_data >> 2];
+  int op = user_data & 3;
+  // op 1 is the read or write, which has to move the whole file; opens and
+  // closes return 0 for direct descriptors.
+  if (res < 0 || (op == 1 && (size_t) res != file->size))
+    file->failed = 1;
+}
+
+static void uring_queue_chain(struct uring* ring, int slot, const char* path, int open_flags,
+                              int rw_opcode, struct uring_file* file) {
+  uint64_t id = (uint64_t) slot << 2;
+  struct io_uring_sqe* sqe = uring_sqe(ring, IORING_OP_OPENAT, id);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t) path;
+  sqe->open_flags = open_flags;
+  sqe->len = 0666;
+  sqe->file_index = slot + 1;
+  sqe->flags = IOSQE_IO_LINK;
+
+  if (file->size > 0) {
+    sqe = uring_sqe(ring, rw_opcode, id | 1);
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t) file->data;
+    sqe->len = file->size;
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+  }
+
+  sqe = uring_sqe(ring, IORING_OP_CLOSE, id | 2);
+  sqe->file_index = slot + 1;
+}
+
+static const char uring_chunk_magic[16] = "\0beargit-chunks\n";
+
+/* Copies <count> small files with io_uring. Jobs it can't handle (chunked
+ * snapshot files, any failure) are appended to <leftover> for the thread pool,
+ * which also reports real errors. Returns 1 if io_uring can't be used at all.
+ */
+static int copy_jobs_uring(struct copy_job** jobs, int count,
+                           struct copy_job** leftover, int* num_leftover) {
+  struct uring ring;
+  if (uring_init(&ring, 4 * COPY_WINDOW, COPY_WINDOW) != 0)
+    return 1;
+
+  struct uring_file files[COPY_WINDOW];
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  for (int start = 0; start < count; start += COPY_WINDOW) {
+    int n = count - start < COPY_WINDOW ? count - start : COPY_WINDOW;
+
+    // One buffer holds the whole window.
+    size_t window_size = 0;
+    for (int i = 0; i < n; i++)
+      window_size += jobs[start + i]->size;
+    if (window_size > buffer_size) {
+      free(buffer);
+      buffer_size = window_size;
+      buffer = malloc(buffer_size);
+    }
+    if (buffer == NULL && window_size > 0) {
+      // The thread pool copies these a buffer at a time instead.
+      for (int i = 0; i < n; i++)
+        leftover[(*num_leftover)++] = jobs[start + i];
+      buffer_size = 0;
+      continue;
+    }
+
+    // Phase 1: read every source file of the window into memory.
+    size_t offset = 0;
+    for (int i = 0; i < n; i++) {
+      files[i].job = jobs[start + i];
+      files[i].failed = 0;
+      files[i].size = files[i].job->size;
+      files[i].data = buffer + offset;
+      offset += files[i].size;
+      uring_queue_chain(&ring, i, files[i].job->src, O_RDONLY, IORING_OP_READ, &files[i]);
+    }
+    if (uring_run(&ring, uring_complete, files) != 0) {
+      for (int i = 0; i < n; i++)
+        files[i].failed = 1;
+    }
+
+    // Chunk lists can't be restored by a plain copy.
+    for (int i = 0; i < n; i++) {
+      if (files[i].job->kind == COPY_RESTORE && files[i].size >= sizeof(uring_chunk_magic)
+          && memcmp(files[i].data, uring_chunk_magic, sizeof(uring_chunk_magic)) == 0)
+        files[i].failed = 1;
+    }
+
+    // Phase 2: write them all out.
+    for (int i = 0; i < n; i++) {
+      if (!files[i].failed)
+        uring_queue_chain(&ring, i, files[i].job->dst, O_WRONLY | O_CREAT | O_TRUNC,
+                          IORING_OP_WRITE, &files[i]);
+    }
+    if (uring_run(&ring, uring_complete, files) != 0) {
+      for (int i = 0; i < n; i++)
+        files[i].failed = 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (files[i].failed) {
+        leftover[(*num_leftover)++] = files[i].job;
+      } else {
+        if (files[i].job->kind == COPY_SNAPSHOT) {
+          unsigned char md[SHA_DIGEST_LENGTH];
+          SHA1((unsigned char*) files[i].data, files[i].size, md);
+          sha1_to_hex(md, files[i].job->digest);
+          TRACE_COUNT(TRACE_HASHES, 1);
+        }
+        TRACE_COUNT(TRACE_FILES_COPIED, 1);
+        TRACE_COUNT(TRACE_BYTES_MOVED, files[i].size);
+      }
+    }
+  }
+
+  free(buffer);
+  uring_exit(&ring);
+  return 0;
+}
+#endif // HAVE_IO_URING
+
+void copy_batch_run(struct copy_batch* batch) {
+  if (batch->count == 0)
+    return;
+  TRACE_BEGIN(span, "copy_batch_run");
+
+  const char* engine = getenv("BEARGIT_IO_ENGINE");
+  if (engine && strcmp(engine, "sync") == 0) {
+    for (int i = 0; i < batch->count; i++)
+      copy_job_run(&batch->jobs[i]);
+    TRACE_END(span);
+    return;
+  }
+
+  struct copy_job** small = malloc(batch->count * sizeof(struct copy_job*));
+  struct copy_job** large = malloc(batch->count * sizeof(struct copy_job*));
+  int num_small = 0, num_large = 0;
+  int use_uring = !(engine && strcmp(engine, "threads") == 0);
+
+#ifdef HAVE_IO_URING
+  // Snapshots of large files get chunked, so only small ones can be copied
+  // verbatim.
+  for (int i = 0; i < batch->count && use_uring; i++) {
+    struct stat s;
+    struct copy_job* job = &batch->jobs[i];
+    if (stat(job->src, &s) == 0 && s.st_size < COPY_SMALL_FILE) {
+      job->size = s.st_size;
+      small[num_small++] = job;
+    }
+    else
+      large[num_large++] = job;
+  }
+  if (use_uring && copy_jobs_uring(small, num_small, large, &num_large) != 0) {
+    // No io_uring here; everything goes to the thread pool.
+    memcpy(large + num_large, small, num_small * sizeof(struct copy_job*));
+    num_large += num_small;
+  }
+#else
+  use_uring = 0;
+#endif
+  if (!use_uring) {
+    for (int i = 0; i < batch->count; i++)
+      large[num_large++] = &batch->jobs[i];
+  }
+
+  copy_jobs_threaded(large, num_large);
+
+  free(small);
+  free(large);
+  TRACE_END(span);
+}
+
+/* Indexes */
+
+void index_append(struct arena* arena, struct index* index, const char* path) {
+  if (index->count == index->capacity) {
+    int capacity = index->capacity ? 2 * index->capacity : 64;
+    const char** paths = arena_alloc(arena, capacity * sizeof(char*));
+    if (index->count)
+      memcpy(paths, index->paths, index->count * sizeof(char*));
+    index->paths = paths;
+    index->capacity = capacity;
+  }
+  index->paths[index->count++] = arena_intern(arena, path);
+}
+
+// Loads <filename> (one path per line, no length limit) into <index>. A
+// missing file is an empty index.
+void index_load(struct arena* arena, const char* filename, struct index* index) {
+  index->paths = NULL;
+  index->count = 0;
+  index->capacity = 0;
+
+  if (is_object_path(filename)) {
+    size_t size;
+    char* data = object_read(filename, &size);
+    if (data == NULL)
+      return;
+    for (char* line = data; line < data + size; ) {
+      char* end = memchr(line, '\n', data + size - line);
+      if (end)
+        *end = '\0';
+      TRACE_COUNT(TRACE_INDEX_ENTRIES, 1);
+      if (*line)
+        index_append(arena, index, line);
+      line = end ? end + 1 : data + size;
+    }
+    free(data);
+    return;
+  }
+
+  FILE* findex = fopen(filename, "r");
+  if (findex == NULL)
+    return;
+
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, findex)) > 0) {
+    TRACE_COUNT(TRACE_INDEX_ENTRIES, 1);
+    if (line[len - 1] == '\n')
+      line[--len] = '\0';
+    if (len > 0)
+      index_append(arena, index, line);
+  }
+  free(line);
+  fclose(findex);
+}
+
+// Returns the position of <path> in <index>, or -1.
+int index_find(const struct index* index, const char* path) {
+  for (int i = 0; i < index->count; i++) {
+    if (index->paths[i] == path || strcmp(index->paths[i], path) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Replaces <filename> with the contents of <index>.
+void index_write(const char* filename, const struct index* index) {
+  char* tmp = malloc(strlen(filename) + 5);
+  sprintf(tmp, "%s.new", filename);
+  FILE* fout = fopen(tmp, "w");
+  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't write index");
+  for (int i = 0; i < index->count; i++)
+    fprintf(fout, "%s\n", index->paths[i]);
+  fclose(fout);
+  fs_mv(tmp, filename);
+  free(tmp);
+}
+
+/* Object cache (see util.h) */
+
+struct cached_object {
+  char* key;
+  char* data;
+  size_t size;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  uint64_t hash;
+  struct cached_object* newer;
+  struct cached_object* older;
+  struct cached_object* chain;
+};
+
+struct object_shard {
+  pthread_mutex_t lock;
+  struct cached_object** buckets;
+  size_t num_buckets;
+  size_t count;
+  size_t bytes;
+  struct cached_object* newest;
+  struct cached_object* oldest;
+};
+
+static struct object_shard object_shards[OBJECT_CACHE_SHARDS];
+static pthread_once_t object_cache_once = PTHREAD_ONCE_INIT;
+
+static void object_cache_init(void) {
+  for (int i = 0; i < OBJECT_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&object_shards[i].lock, NULL);
+    object_shards[i].num_buckets = 256;
+    object_shards[i].buckets = calloc(256, sizeof(struct cached_object*));
+  }
+}
+
+static int is_hex_run(const char* s, int length) {
+  for (int i = 0; i < length; i++) {
+    if (!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f')))
+      return 0;
+  }
+  return 1;
+}
+
+// Whether <filename> is a file inside a commit directory that never changes
+// once written (everything but the blame caches).
+int is_object_path(const char* filename) {
+  const char* id;
+  if (strncmp(filename, OBJECTS_DIR "/", strlen(OBJECTS_DIR) + 1) == 0)
+    id = filename + strlen(OBJECTS_DIR) + 1;
+  else if (strncmp(filename, OBJECTS_MIGRATING "/", strlen(OBJECTS_MIGRATING) + 1) == 0)
+    id = filename + strlen(OBJECTS_MIGRATING) + 1;
+  else if (strncmp(filename, ".beargit/", 9) == 0)
+    id = filename + 9;
+  else
+    return 0;
+  int length = SHA_HEX_BYTES;
+  if (id != filename + 9) {
+    // Sharded: <first two digits>/<other 38>
+    if (!is_hex_run(id, 2) || id[2] != '/')
+      return 0;
+    id += 3;
+    length -= 2;
+  }
+  return is_hex_run(id, length) && id[length] == '/'
+         && strncmp(id + length + 1, ".blame.", 7) != 0;
+}
+
+static uint64_t object_hash(const char* key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (; *key; key++)
+    hash = (hash ^ (unsigned char) *key) * 1099511628211ULL;
+  return hash;
+}
+
+static struct cached_object** object_slot(struct object_shard* shard, const char* key,
+                                          uint64_t hash) {
+  struct cached_object** slot = &shard->buckets[hash & (shard->num_buckets - 1)];
+  while (*slot && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0))
+    slot = &(*slot)->chain;
+  return slot;
+}
+
+static void object_unlink_lru(struct object_shard* shard, struct cached_object* object) {
+  if (object->newer)
+    object->newer->older = object->older;
+  else
+    shard->newest = object->older;
+  if (object->older)
+    object->older->newer = object->newer;
+  else
+    shard->oldest = object->newer;
+}
+
+static void object_push_lru(struct object_shard* shard, struct cached_object* object) {
+  object->newer = NULL;
+  object->older = shard->newest;
+  if (shard->newest)
+    shard->newest->newer = object;
+  else
+    shard->oldest = object;
+  shard->newest = object;
+}
+
+// Drops <object>, which <slot> points to, from <shard>.
+static void object_remove(struct object_shard* shard, struct cached_object** slot) {
+  struct cached_object* object = *slot;
+  *slot = object->chain;
+  object_unlink_lru(shard, object);
+  shard->count--;
+  shard->bytes -= object->size;
+  free(object->key);
+  free(object->data);
+  free(object);
+}
+
+static void object_grow(struct object_shard* shard) {
+  size_t num_buckets = 2 * shard->num_buckets;
+  struct cached_object** buckets = calloc(num_buckets, sizeof(struct cached_object*));
+  for (size_t i = 0; i < shard->num_buckets; i++) {
+    struct cached_object* object = shard->buckets[i];
+    while (object) {
+      struct cached_object* next = object->chain;
+      object->chain = buckets[object->hash & (num_buckets - 1)];
+      buckets[object->hash & (num_buckets - 1)] = object;
+      object = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->num_buckets = num_buckets;
+}
+
+static int object_matches(const struct cached_object* object, const struct stat* s) {
+  return object->dev == s->st_dev && object->ino == s->st_ino
+         && object->size == (size_t) s->st_size
+         && object->mtime.tv_sec == s->st_mtim.tv_sec
+         && object->mtime.tv_nsec == s->st_mtim.tv_nsec;
+}
+
+static char* object_copy(const char* data, size_t size) {
+  char* copy = malloc(size + 1);
+  ASSERT_ERROR_MESSAGE(copy != NULL, "out of memory");
+  memcpy(copy, data, size);
+  copy[size] = '\0';
+  return copy;
+}
+
+char* object_read(const char* filename, size_t* size) {
+  pthread_once(&object_cache_once, object_cache_init);
+  struct stat s;
+  if (stat(filename, &s) != 0 || !S_ISREG(s.st_mode))
+    return NULL;
+  int cacheable = is_object_path(filename) && s.st_size <= OBJECT_CACHE_MAX_OBJECT;
+  uint64_t hash = object_hash(filename);
+  struct object_shard* shard = &object_shards[(hash >> 56) % OBJECT_CACHE_SHARDS];
+
+  if (cacheable) {
+    pthread_mutex_lock(&shard->lock);
+    struct cached_object** slot = object_slot(shard, filename, hash);
+    if (*slot && object_matches(*slot, &s)) {
+      object_unlink_lru(shard, *slot);
+      object_push_lru(shard, *slot);
+      char* copy = object_copy((*slot)->data, (*slot)->size);
+      *size = (*slot)->size;
+      pthread_mutex_unlock(&shard->lock);
+      TRACE_COUNT(TRACE_CACHE_HITS, 1);
+      return copy;
+    }
+    if (*slot)
+      object_remove(shard, slot);
+    pthread_mutex_unlock(&shard->lock);
+  }
+
+  TRACE_COUNT(TRACE_CACHE_MISSES, 1);
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  char* data = malloc(s.st_size + 1);
+  ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+  size_t total = 0;
+  ssize_t n;
+  while (total < (size_t) s.st_size && (n = read(fd, data + total, s.st_size - total)) > 0)
+    total += n;
+  close(fd);
+  data[total] = '\0';
+  *size = total;
+  TRACE_COUNT(TRACE_SYSCALLS, 4);
+  TRACE_COUNT(TRACE_BYTES_MOVED, total);
+  if (!cacheable || total != (size_t) s.st_size)
+    return data;
+
+  struct cached_object* object = malloc(sizeof(*object));
+  object->key = strdup(filename);
+  object->data = object_copy(data, total);
+  object->size = total;
+  object->dev = s.st_dev;
+  object->ino = s.st_ino;
+  object->mtime = s.st_mtim;
+  object->hash = hash;
+  pthread_mutex_lock(&shard->lock);
+  struct cached_object** slot = object_slot(shard, filename, hash);
+  // Another thread may have read it in the meantime
+  if (*slot)
+    object_remove(shard, slot);
+  object->chain = NULL;
+  *object_slot(shard, filename, hash) = object;
+  object_push_lru(shard, object);
+  shard->count++;
+  shard->bytes += total;
+  while (shard->bytes > OBJECT_CACHE_SIZE / OBJECT_CACHE_SHARDS && shard->oldest != object) {
+    struct cached_object* oldest = shard->oldest;
+    object_remove(shard, object_slot(shard, oldest->key, oldest->hash));
+    TRACE_COUNT(TRACE_CACHE_EVICTIONS, 1);
+  }
+  if (shard->count > 2 * shard->num_buckets)
+    object_grow(shard);
+  pthread_mutex_unlock(&shard->lock);
+  return data;
+}
+
+// Empties the cache, e.g. when a repository is created where another was.
+void object_cache_clear(void) {
+  pthread_once(&object_cache_once, object_cache_init);
+  for (int i = 0; i < OBJECT_CACHE_SHARDS; i++) {
+    struct object_shard* shard = &object_shards[i];
+    pthread_mutex_lock(&shard->lock);
+    while (shard->oldest)
+      object_remove(shard, object_slot(shard, shard->oldest->key, shard->oldest->hash));
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+/* Bitmaps (see util.h) */
+
+#define EWAH_MAX_RUN 0xffffffffULL
+#define EWAH_MAX_LITERALS 0x7fffffffULL
+#define EWAH_ALL_ONES (~0ULL)
+
+static const char bitmap_magic[4] = { 'B', 'G', 'B', 'M' };
+
+struct bitmap_header {
+  char magic[4];
+  uint32_t position;
+  uint32_t words;
+  uint32_t compressed;
+};
+
+void bitmap_init(struct bitmap* bitmap) {
+  bitmap->words = NULL;
+  bitmap->count = 0;
+  bitmap->capacity = 0;
+}
+
+void bitmap_free(struct bitmap* bitmap) {
+  free(bitmap->words);
+  bitmap_init(bitmap);
+}
+
+static void bitmap_grow(struct bitmap* bitmap, size_t count) {
+  if (count <= bitmap->count)
+    return;
+  if (count > bitmap->capacity) {
+    size_t capacity = bitmap->capacity ? bitmap->capacity : 16;
+    while (capacity < count)
+      capacity *= 2;
+    bitmap->words = realloc(bitmap->words, capacity * sizeof(uint64_t));
+    ASSERT_ERROR_MESSAGE(bitmap->words != NULL, "out of memory");
+    bitmap->capacity = capacity;
+  }
+  memset(bitmap->words + bitmap->count, 0, (count - bitmap->count) * sizeof(uint64_t));
+  bitmap->count = count;
+}
+
+void bitmap_copy(struct bitmap* dst, const struct bitmap* src) {
+  dst->count = 0;
+  bitmap_grow(dst, src->count);
+  if (src->count)
+    memcpy(dst->words, src->words, src->count * sizeof(uint64_t));
+}
+
+void bitmap_set(struct bitmap* bitmap, size_t bit) {
+  bitmap_grow(bitmap, bit / 64 + 1);
+  bitmap->words[bit / 64] |= 1ULL << (bit % 64);
+}
+
+int bitmap_get(const struct bitmap* bitmap, size_t bit) {
+  if (bit / 64 >= bitmap->count)
+    return 0;
+  return (bitmap->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+size_t bitmap_count(const struct bitmap* bitmap) {
+  size_t count = 0;
+  for (size_t i = 0; i < bitmap->count; i++)
+    count += __builtin_popcountll(bitmap->words[i]);
+  return count;
+}
+
+void bitmap_or(struct bitmap* dst, const struct bitmap* src) {
+  bitmap_grow(dst, src->count);
+  for (size_t i = 0; i < src->count; i++)
+    dst->words[i] |= src->words[i];
+}
+
+void bitmap_andnot(struct bitmap* dst, const struct bitmap* src) {
+  size_t count = dst->count < src->count ? dst->count : src->count;
+  for (size_t i = 0; i < count; i++)
+    dst->words[i] &= ~src->words[i];
+}
+
+// Writes <bitmap>, the ancestry of the commit at <position>, to <filename>.
+void bitmap_write(const char* filename, const struct bitmap* bitmap, uint32_t position) {
+  uint64_t* out = malloc((2 * bitmap->count + 1) * sizeof(uint64_t));
+  ASSERT_ERROR_MESSAGE(out != NULL, "out of memory");
+  size_t compressed = 0;
+  size_t i = 0;
+  while (i < bitmap->count) {
+    uint64_t run_bit = 0;
+    uint64_t run = 0;
+    if (bitmap->words[i] == 0 || bitmap->words[i] == EWAH_ALL_ONES) {
+      uint64_t clean = bitmap->words[i];
+      run_bit = clean & 1;
+      while (i < bitmap->count && bitmap->words[i] == clean && run < EWAH_MAX_RUN) {
+        run++;
+        i++;
+      }
+    }
+    size_t literals = i;
+    while (i < bitmap->count && bitmap->words[i] != 0 && bitmap->words[i] != EWAH_ALL_ONES
+           && i - literals < EWAH_MAX_LITERALS)
+      i++;
+    out[compressed++] = run_bit | (run << 1) | ((uint64_t) (i - literals) << 33);
+    memcpy(out + compressed, bitmap->words + literals, (i - literals) * sizeof(uint64_t));
+    compressed += i - literals;
+  }
+
+  struct bitmap_header header;
+  memcpy(header.magic, bitmap_magic, sizeof(bitmap_magic));
+  header.position = position;
+  header.words = bitmap->count;
+  header.compressed = compressed;
+
+  char* tmp = malloc(strlen(filename) + 5);
+  sprintf(tmp, "%s.new", filename);
+  FILE* fout = fopen(tmp, "w");
+  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't write bitmap");
+  fwrite(&header, sizeof(header), 1, fout);
+  fwrite(out, sizeof(uint64_t), compressed, fout);
+  fclose(fout);
+  fs_mv(tmp, filename);
+  free(tmp);
+  free(out);
+}
+
+// Reads a bitmap written by bitmap_write into <bitmap>, which must have been
+// initialized. Returns 0 on success, 1 if the file is missing or corrupt.
+int bitmap_read(const char* filename, struct bitmap* bitmap, uint32_t* position) {
+  size_t size;
+  char* data = object_read(filename, &size);
+  if (data == NULL)
+    return 1;
+  struct bitmap_header header;
+  uint64_t* in = NULL;
+  int ret = 1;
+  if (size < sizeof(header))
+    goto out;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, bitmap_magic, sizeof(bitmap_magic)) != 0
+      || (size - sizeof(header)) / sizeof(uint64_t) < header.compressed)
+    goto out;
+  in = malloc((header.compressed + 1) * sizeof(uint64_t));
+  ASSERT_ERROR_MESSAGE(in != NULL, "out of memory");
+  memcpy(in, data + sizeof(header), header.compressed * sizeof(uint64_t));
+
+  bitmap->count = 0;
+  bitmap_grow(bitmap, header.words);
+  size_t word = 0;
+  size_t i = 0;
+  while (i < header.compressed) {
+    uint64_t marker = in[i++];
+    uint64_t run = (marker >> 1) & EWAH_MAX_RUN;
+    uint64_t literals = marker >> 33;
+    if (word + run + literals > header.words || i + literals > header.compressed)
+      goto out;
+    if (marker & 1)
+      memset(bitmap->words + word, 0xff, run * sizeof(uint64_t));
+    word += run;
+    memcpy(bitmap->words + word, in + i, literals * sizeof(uint64_t));
+    word += literals;
+    i += literals;
+  }
+  if (word != header.words)
+    goto out;
+  *position = header.position;
+  ret = 0;
+out:
+  free(in);
+  free(data);
+  return ret;
+}
+
+/* Tracing (see util.h) */
+
+#define TRACE_DEFAULT_FILE "beargit-trace.json"
+
+int trace_enabled = 0;
+long long trace_counters[TRACE_NUM_COUNTERS];
+
+static const char* counter_names[TRACE_NUM_COUNTERS] = {
+  "files_copied",
+  "bytes_moved",
+  "syscalls",
+  "index_entries_scanned",
+  "dirs_created",
+  "hashes",
+  "object_cache_hits",
+  "object_cache_misses",
+  "object_cache_evictions",
+};
+
+struct span {
+  const char* name;
+  double start_us;
+  double dur_us;
+};
+
+static struct span* spans = NULL;
+static int num_spans = 0;
+static int spans_capacity = 0;
+static double origin_us = 0;
+static const char* chrome_file = NULL;
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void write_chrome_trace(void) {
+  FILE* fout = fopen(chrome_file, "w");
+  if (fout == NULL) {
+    fprintf(stderr, "ERROR:  Cannot write trace to %s.\n", chrome_file);
+    return;
+  }
+
+  int pid = getpid();
+  fprintf(fout, "{\"traceEvents\": [\n");
+  for (int i = 0; i < num_spans; i++) {
+    fprintf(fout, "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+            "\"pid\": %d, \"tid\": 1},\n", spans[i].name, spans[i].start_us,
+            spans[i].dur_us, pid);
+  }
+  fprintf(fout, "{\"name\": \"counters\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": %d, "
+          "\"args\": {", now_us() - origin_us, pid);
+  for (int i = 0; i < TRACE_NUM_COUNTERS; i++) {
+    fprintf(fout, "%s\"%s\": %lld", i ? ", " : "", counter_names[i], trace_counters[i]);
+  }
+  fprintf(fout, "}}\n]}\n");
+  fclose(fout);
+}
+
+static void write_summary(void) {
+  // Aggregate spans by name. Span names are string literals, so comparing the
+  // pointers first makes this cheap.
+  const char* names[64];
+  int counts[64];
+  double totals[64], maxima[64];
+  int num_names = 0;
+
+  for (int i = 0; i < num_spans; i++) {
+    int j;
+    for (j = 0; j < num_names; j++) {
+      if (names[j] == spans[i].name || strcmp(names[j], spans[i].name) == 0)
+        break;
+    }
+    if (j == num_names) {
+      if (num_names == 64)
+        continue;
+      names[j] = spans[i].name;
+      counts[j] = 0;
+      totals[j] = maxima[j] = 0;
+      num_names++;
+    }
+    counts[j]++;
+    totals[j] += spans[i].dur_us;
+    if (spans[i].dur_us > maxima[j])
+      maxima[j] = spans[i].dur_us;
+  }
+
+  fprintf(stderr, "\n%-24s %10s %12s %12s %12s\n", "span", "count", "total ms",
+          "avg us", "max us");
+  for (int j = 0; j < num_names; j++) {
+    fprintf(stderr, "%-24s %10d %12.3f %12.1f %12.1f\n", names[j], counts[j],
+            totals[j] / 1e3, totals[j] / counts[j], maxima[j]);
+  }
+  fprintf(stderr, "\n%-24s %10s\n", "counter", "value");
+  for (int i = 0; i < TRACE_NUM_COUNTERS; i++) {
+    fprintf(stderr, "%-24s %10lld\n", counter_names[i], trace_counters[i]);
+  }
+  fprintf(stderr, "\ntotal wall time: %.3f ms\n", (now_us() - origin_us) / 1e3);
+}
+
+static void trace_finish(void) {
+  if (chrome_file)
+    write_chrome_trace();
+  else
+    write_summary();
+  free(spans);
+}
+
+void trace_init(void) {
+  const char* mode = getenv("BEARGIT_TRACE");
+  if (mode == NULL || strlen(mode) == 0 || strcmp(mode, "0") == 0)
+    return;
+
+  if (strncmp(mode, "chrome", 6) == 0)
+    chrome_file = mode[6] == ':' && mode[7] ? mode + 7 : TRACE_DEFAULT_FILE;
+
+  origin_us = now_us();
+  trace_enabled = 1;
+  atexit(trace_finish);
+}
+
+// Spans may be opened from the copy workers, so the span table is locked.
+static pthread_mutex_t spans_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int trace_begin(const char* name) {
+  pthread_mutex_lock(&spans_lock);
+  if (num_spans == spans_capacity) {
+    int capacity = spans_capacity ? 2 * spans_capacity : 256;
+    struct span* grown = realloc(spans, capacity * sizeof(struct span));
+    if (grown == NULL) {
+      pthread_mutex_unlock(&spans_lock);
+      return -1;
+    }
+    spans = grown;
+    spans_capacity = capacity;
+  }
+
+  int span = num_spans++;
+  spans[span].name = name;
+  spans[span].start_us = now_us() - origin_us;
+  spans[span].dur_us = 0;
+  pthread_mutex_unlock(&spans_lock);
+  return span;
+}
+
+void trace_end(int span) {
+  double end_us = now_us() - origin_us;
+  pthread_mutex_lock(&spans_lock);
+  spans[span].dur_us = end_us - spans[span].start_us;
+  pthread_mutex_unlock(&spans_lock);
+}
+
+/* Ignore rules (see util.h) */
+
+// Glob matching for ignore patterns: "*" and "?" stop at "/", "**" doesn't,
+// and [...] is a character class.
+static int glob_match(const char* pattern, const char* str) {
+  while (*pattern) {
+    if (pattern[0] == '*' && pattern[1] == '*') {
+      pattern += 2;
+      // "**/" also matches no directory at all
+      if (*pattern == '/' && glob_match(pattern + 1, str))
+        return 1;
+      for (const char* s = str; ; s++) {
+        if (glob_match(pattern, s))
+          return 1;
+        if (*s == '\0')
+          return 0;
+      }
+    }
+    if (*pattern == '*') {
+      pattern++;
+      for (const char* s = str; ; s++) {
+        if (glob_match(pattern, s))
+          return 1;
+        if (*s == '\0' || *s == '/')
+          return 0;
+      }
+    }
+    if (*str == '\0')
+      return 0;
+    if (*pattern == '?') {
+      if (*str == '/')
+        return 0;
+    } else if (*pattern == '[') {
+      const char* p = pattern + 1;
+      int negate = *p == '!' || *p == '^';
+      p += negate;
+      int found = 0;
+      do {
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+          found |= *str >= p[0] && *str <= p[2];
+          p += 3;
+        } else {
+          found |= *str == *p;
+          p++;
+        }
+      } while (*p && *p != ']');
+      if (*p == '\0')
+        return 0;
+      if (found == negate || *str == '/')
+        return 0;
+      pattern = p;
+    } else {
+      if (*pattern == '\\' && pattern[1])
+        pattern++;
+      if (*pattern != *str)
+        return 0;
+    }
+    pattern++;
+    str++;
+  }
+  return *str == '\0';
+}
+
+// The last rule (as index + 1, 0 for none) for a key, and the last one that
+// also applies to files.
+struct ignore_slot {
+  int any;
+  int files;
+};
+
+static void ignore_slot_put(struct arena* arena, struct strset* set, const char* key,
+                            int rule, int dir_only) {
+  struct ignore_slot* slot = (struct ignore_slot*) strset_value(set, key);
+  if (slot == NULL) {
+    slot = arena_alloc(arena, sizeof(*slot));
+    slot->any = slot->files = 0;
+    strset_put(set, key, slot);
+  }
+  slot->any = rule + 1;
+  if (!dir_only)
+    slot->files = rule + 1;
+}
+
+static int ignore_slot_get(const struct strset* set, const char* key, int is_dir) {
+  const struct ignore_slot* slot = strset_value(set, key);
+  if (slot == NULL)
+    return -1;
+  return (is_dir ? slot->any : slot->files) - 1;
+}
+
+void ignore_load(struct arena* arena, const char* filename, struct ignore_rules* rules) {
+  memset(rules, 0, sizeof(*rules));
+  rules->names = strset_new_in(arena);
+  rules->extensions = strset_new_in(arena);
+  rules->paths = strset_new_in(arena);
+
+  FILE* fin = fopen(filename, "r");
+  if (fin == NULL)
+    return;
+  char line[PATH_MAX + 2];
+  int capacity = 0;
+  while (fgets(line, sizeof(line), fin)) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+      line[--len] = '\0';
+    if (len == 0 || line[0] == '#')
+      continue;
+
+    struct ignore_rule rule = { NULL, 0, 0, 0 };
+    char* pattern = line;
+    if (*pattern == '!') {
+      rule.negate = 1;
+      pattern++;
+    }
+    len = strlen(pattern);
+    if (len > 0 && pattern[len - 1] == '/') {
+      rule.dir_only = 1;
+      pattern[--len] = '\0';
+    }
+    // A "/" anywhere but the end ties the pattern to the top of the tree
+    rule.anchored = strchr(pattern, '/') != NULL;
+    if (*pattern == '/')
+      pattern++;
+    if (*pattern == '\0')
+      continue;
+    rule.pattern = arena_strdup(arena, pattern);
+
+    if (rules->count == capacity) {
+      capacity = capacity ? 2 * capacity : 16;
+      struct ignore_rule* grown = arena_alloc(arena, capacity * sizeof(*grown));
+      if (rules->count)
+        memcpy(grown, rules->rules, rules->count * sizeof(*grown));
+      rules->rules = grown;
+    }
+    int index = rules->count++;
+    rules->rules[index] = rule;
+
+    // Sort the rule into the bucket that can find it without globbing
+    int glob = strpbrk(pattern, "*?[\\") != NULL;
+    if (!glob) {
+      ignore_slot_put(arena, rule.anchored ? rules->paths : rules->names, pattern,
+                      index, rule.dir_only);
+    } else if (!rule.anchored && pattern[0] == '*' && pattern[1] == '.'
+               && strpbrk(pattern + 2, "*?[\\.") == NULL) {
+      ignore_slot_put(arena, rules->extensions, pattern + 2, index, rule.dir_only);
+    } else {
+      if (rules->num_globs == rules->globs_capacity) {
+        rules->globs_capacity = rules->globs_capacity ? 2 * rules->globs_capacity : 16;
+        int* grown = arena_alloc(arena, rules->globs_capacity * sizeof(int));
+        if (rules->num_globs)
+          memcpy(grown, rules->globs, rules->num_globs * sizeof(int));
+        rules->globs = grown;
+      }
+      rules->globs[rules->num_globs++] = index;
+    }
+  }
+  fclose(fin);
+}
+
+int ignore_match(const struct ignore_rules* rules, const char* path, int is_dir) {
+  if (rules->count == 0)
+    return 0;
+  const char* name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  const char* extension = strrchr(name, '.');
+
+  int best = ignore_slot_get(rules->names, name, is_dir);
+  int rule = ignore_slot_get(rules->paths, path, is_dir);
+  if (rule > best)
+    best = rule;
+  if (extension) {
+    rule = ignore_slot_get(rules->extensions, extension + 1, is_dir);
+    if (rule > best)
+      best = rule;
+  }
+  // Only rules after the best match so far can change the outcome
+  for (int i = rules->num_globs - 1; i >= 0 && rules->globs[i] > best; i--) {
+    const struct ignore_rule* glob = &rules->rules[rules->globs[i]];
+    if (glob->dir_only && !is_dir)
+      continue;
+    if (glob_match(glob->pattern, glob->anchored ? path : name)) {
+      best = rules->globs[i];
+      break;
+    }
+  }
+  return best >= 0 && !rules->rules[best].negate;
+}
+
+/* Working tree walks (see util.h) */
+
+struct walk_state {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  char** dirs;          // directories waiting to be read
+  int num_dirs;
+  int dirs_capacity;
+  int busy;             // threads reading a directory
+  const struct ignore_rules* rules;
+  const struct strset* tracked;
+};
+
+struct walk_worker {
+  struct walk_state* state;
+  char** found;
+  size_t count;
+  size_t capacity;
+};
+
+static void walk_push_dir(struct walk_state* state, char* dir) {
+  pthread_mutex_lock(&state->lock);
+  if (state->num_dirs == state->dirs_capacity) {
+    state->dirs_capacity = state->dirs_capacity ? 2 * state->dirs_capacity : 64;
+    state->dirs = realloc(state->dirs, state->dirs_capacity * sizeof(char*));
+  }
+  state->dirs[state->num_dirs++] = dir;
+  pthread_cond_signal(&state->ready);
+  pthread_mutex_unlock(&state->lock);
+}
+
+static void walk_read_dir(struct walk_worker* worker, const char* dir) {
+  struct walk_state* state = worker->state;
+  DIR* d = opendir(*dir ? dir : ".");
+  if (d == NULL)
+    return;
+  TRACE_COUNT(TRACE_SYSCALLS, 2);
+  struct dirent* entry;
+  while ((entry = readdir(d)) != NULL) {
+    const char* name = entry->d_name;
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+      continue;
+    // Whatever the root, a walk never descends into a repository's metadata
+    if (strcmp(name, ".beargit") == 0)
+      continue;
+    size_t dir_len = strlen(dir);
+    char* path = malloc(dir_len + strlen(name) + 2);
+    if (dir_len)
+      sprintf(path, "%s/%s", dir, name);
+    else
+      strcpy(path, name);
+
+    int type = entry->d_type;
+    if (type == DT_UNKNOWN) {
+      struct stat s;
+      type = lstat(path, &s) != 0 ? DT_UNKNOWN
+             : S_ISDIR(s.st_mode) ? DT_DIR : S_ISREG(s.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if (type == DT_DIR && !ignore_match(state->rules, path, 1)) {
+      walk_push_dir(state, path);
+      continue;
+    }
+    if (type == DT_REG && !ignore_match(state->rules, path, 0)
+        && !strset_contains(state->tracked, path)) {
+      if (worker->count == worker->capacity) {
+        worker->capacity = worker->capacity ? 2 * worker->capacity : 256;
+        worker->found = realloc(worker->found, worker->capacity * sizeof(char*));
+      }
+      worker->found[worker->count++] = path;
+      continue;
+    }
+    free(path);
+  }
+  closedir(d);
+}
+
+static void* walk_worker_run(void* arg) {
+  struct walk_worker* worker = arg;
+  struct walk_state* state = worker->state;
+  pthread_mutex_lock(&state->lock);
+  while (1) {
+    while (state->num_dirs == 0 && state->busy > 0)
+      pthread_cond_wait(&state->ready, &state->lock);
+    // Nothing queued and nobody left to queue more: the walk is over
+    if (state->num_dirs == 0)
+      break;
+    char* dir = state->dirs[--state->num_dirs];
+    state->busy++;
+    pthread_mutex_unlock(&state->lock);
+    walk_read_dir(worker, dir);
+    free(dir);
+    pthread_mutex_lock(&state->lock);
+    state->busy--;
+    if (state->busy == 0 && state->num_dirs == 0)
+      pthread_cond_broadcast(&state->ready);
+  }
+  pthread_mutex_unlock(&state->lock);
+  return NULL;
+}
+
+static int compare_strings(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+void walk_untracked(struct arena* arena, const char* root, const struct ignore_rules* rules,
+                    const struct strset* tracked, struct index* untracked) {
+  TRACE_BEGIN(span, "walk_untracked");
+  struct walk_state state;
+  memset(&state, 0, sizeof(state));
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.ready, NULL);
+  state.rules = rules;
+  state.tracked = tracked;
+  walk_push_dir(&state, strdup(root));
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cpus < 1 ? 1 : cpus > WALK_MAX_THREADS ? WALK_MAX_THREADS : cpus;
+  struct walk_worker workers[WALK_MAX_THREADS];
+  pthread_t ids[WALK_MAX_THREADS];
+  memset(workers, 0, sizeof(workers));
+  // The workers share one queue, so one that fails to start just leaves its
+  // share to the others.
+  int started = 0;
+  for (int t = 0; t < threads; t++) {
+    workers[t].state = &state;
+    if (t > 0 && pthread_create(&ids[started], NULL, walk_worker_run, &workers[t]) == 0)
+      started++;
+  }
+  walk_worker_run(&workers[0]);
+  for (int t = 0; t < started; t++)
+    pthread_join(ids[t], NULL);
+
+  size_t total = 0;
+  for (int t = 0; t < threads; t++)
+    total += workers[t].count;
+  char** found = malloc((total + 1) * sizeof(char*));
+  total = 0;
+  for (int t = 0; t < threads; t++) {
+    memcpy(found + total, workers[t].found, workers[t].count * sizeof(char*));
+    total += workers[t].count;
+    free(workers[t].found);
+  }
+  qsort(found, total, sizeof(char*), compare_strings);
+  for (size_t i = 0; i < total; i++) {
+    index_append(arena, untracked, found[i]);
+    free(found[i]);
+  }
+  free(found);
+  free(state.dirs);
+  pthread_mutex_destroy(&state.lock);
+  pthread_cond_destroy(&state.ready);
+  TRACE_END(span);
+}
@@ -11,16 +11,21 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <openssl/sha.h>
 
 int fake_print(char* fmt, ...);
 int fake_fprint(FILE* stream, char* fmt, ...);
+const char* capture_get(FILE* stream);
+FILE* capture_open(FILE* stream);
+void capture_clear(FILE* stream);
 int is_sane_path(const char* path);
 
 /* In testing mode (initialized with -DTESTING fed to gcc and done automatically
  * when you run make beargit-unittest), we need to replace printf and fprintf 
- * with "fakes" that redirect your output to files, which you can read from 
- * in your testing code.
+ * with "fakes" that capture your output in memory. Tests read it with
+ * capture_get(stdout) or capture_open(stderr) and start over with
+ * capture_clear.
  */
 #ifdef TESTING
 #define printf fake_print
@@ -59,6 +64,7 @@ static const char* dst = "";
   }
 
 void fs_mkdir(const char* dirname);
+void fs_mkdir_parents(const char* path);
 void fs_rm(const char* filename);
 void fs_force_rm_beargit_dir();
 void fs_mv(const char* src, const char* dst);
@@ -66,9 +72,286 @@ void fs_cp(const char* src, const char* dst);
 void write_string_to_file(const char* filename, const char* str);
 void read_string_from_file(const char* filename, char* str, int size);
 int fs_check_dir_exists(const char* dirname);
+int fs_link(const char* src, const char* dst);
+long long fs_rm_tree(const char* dirname);
+
+/* Large files are stored in commits as a list of content-defined chunks
+ * (FastCDC with a gear rolling hash). Chunks live in .beargit/.chunks/ab/cd..
+ * named by their SHA-1, so unchanged regions of a file are stored once no
+ * matter how many commits contain it. fs_snapshot copies a working file into
+ * a commit (chunking it if it is large; fs_snapshot_chunked whatever its
+ * size), fs_restore copies a snapshot file back
+ * out (fs_restore_stream to an open stream), reassembling chunk lists as it
+ * streams. fs_snapshot_matches compares a snapshot with a working file the
+ * same way, a buffer at a time. fs_snapshot_digest is fs_snapshot that also
+ * returns the SHA-1 of the file's contents in hex, hashed while copying.
+ */
+#define CHUNK_DIR ".beargit/.chunks"
+#define CHUNK_THRESHOLD (1 << 20)
+#define CHUNK_MIN_SIZE (64 << 10)
+#define CHUNK_AVG_BITS 18
+#define CHUNK_MAX_SIZE (1 << 20)
+#define CHUNK_PATH_SIZE 128
+
+struct strset;
+
+void fs_snapshot(const char* src, const char* dst);
+void fs_snapshot_chunked(const char* src, const char* dst);
+void fs_snapshot_digest(const char* src, const char* dst, char* digest);
+void fs_restore(const char* src, const char* dst);
+void fs_restore_stream(const char* src, FILE* out);
+long long fs_snapshot_size(const char* src);
+int fs_snapshot_matches(const char* snapshot, const char* path);
+int fs_is_chunk_list(const char* filename);
+void chunk_path(const char* hash, char* path);
+void chunk_store(const unsigned char* data, size_t len, char* hash);
+void chunk_list_hashes(const char* filename, struct strset* hashes);
 
 #define SHA_HEX_BYTES (SHA_DIGEST_LENGTH * 2)
 
 void cryptohash(const char* str, char dst[SHA_HEX_BYTES + 1]);
 
+/* A bump allocator for everything a single command allocates: paths, index
+ * entries, file lists. Memory is handed out from large blocks and released all
+ * at once with arena_free, so there is no per-string malloc/free and strings
+ * can be shared freely between the stages of a command.
+ */
+#define ARENA_BLOCK_SIZE (64 << 10)
+
+struct arena_block {
+  struct arena_block* next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+struct arena {
+  struct arena_block* blocks;
+  struct strset* interned;
+};
+
+void arena_init(struct arena* arena);
+void* arena_alloc(struct arena* arena, size_t size);
+char* arena_strdup(struct arena* arena, const char* str);
+char* arena_printf(struct arena* arena, const char* fmt, ...);
+const char* arena_intern(struct arena* arena, const char* str);
+void arena_free(struct arena* arena);
+
+/* A set of strings (open addressing with linear probing). Added strings are
+ * copied, into <arena> if the set has one and onto the heap otherwise, so
+ * callers can reuse their buffers. strset_put also attaches a value to a
+ * string, turning the set into a map; values are not copied.
+ */
+struct strset {
+  char** slots;
+  const void** values;
+  int capacity;
+  int count;
+  struct arena* arena;
+};
+
+struct strset* strset_new(void);
+struct strset* strset_new_in(struct arena* arena);
+int strset_add(struct strset* set, const char* str);
+const char* strset_get(const struct strset* set, const char* str);
+int strset_contains(const struct strset* set, const char* str);
+void strset_put(struct strset* set, const char* str, const void* value);
+const void* strset_value(const struct strset* set, const char* str);
+void strset_free(struct strset* set);
+
+/* Batched copies for commands that move many files at once (commit,
+ * checkout, reset). Jobs are collected with copy_batch_add and executed
+ * together by copy_batch_run, which picks an I/O engine:
+ *
+ *  - io_uring (Linux): small files are read and written in windows of
+ *    COPY_WINDOW files, each file as one linked open/read/close and
+ *    open/write/close chain on direct descriptors, so a whole window costs a
+ *    couple of system calls instead of six per file.
+ *  - threads: a pool of workers running the plain fs_cp/fs_snapshot/fs_restore.
+ *    Used for large and chunked files, and for everything if io_uring is
+ *    unavailable.
+ *  - sync: everything in order on the calling thread.
+ *
+ * BEARGIT_IO_ENGINE=uring|threads|sync overrides the choice. Every engine
+ * hashes the files of COPY_SNAPSHOT jobs as it reads them, see
+ * copy_job.digest.
+ */
+#define COPY_WINDOW 64
+#define COPY_SMALL_FILE (256 << 10)
+#define COPY_MAX_THREADS 8
+
+enum copy_kind { COPY_PLAIN, COPY_SNAPSHOT, COPY_RESTORE };
+
+struct copy_job {
+  const char* src;
+  const char* dst;
+  enum copy_kind kind;
+  long size;
+  char digest[SHA_HEX_BYTES + 1];  // SHA-1 of a COPY_SNAPSHOT's contents, once it ran
+};
+
+struct copy_batch {
+  struct copy_job* jobs;
+  int count;
+  int capacity;
+  const char* made_dir;
+};
+
+void copy_batch_init(struct copy_batch* batch);
+void copy_batch_add(struct arena* arena, struct copy_batch* batch, const char* src,
+                    const char* dst, enum copy_kind kind);
+void copy_batch_run(struct copy_batch* batch);
+
+/* The list of tracked files (.beargit/.index or a commit's copy of it),
+ * loaded into an arena. Paths are interned, so two indexes loaded into the
+ * same arena share their strings and can be compared by pointer.
+ */
+struct index {
+  const char** paths;
+  int count;
+  int capacity;
+};
+
+void index_load(struct arena* arena, const char* filename, struct index* index);
+void index_append(struct arena* arena, struct index* index, const char* path);
+int index_find(const struct index* index, const char* path);
+void index_write(const char* filename, const struct index* index);
+
+/* Commit directories: .beargit/objects/ab/cdef.. in repositories created or
+ * migrated since sharding, .beargit/abcdef.. in older ones, and either while
+ * beargit migrate-objects moves them into .beargit/objects.new/ab/cdef..
+ */
+#define OBJECTS_DIR ".beargit/objects"
+#define OBJECTS_MIGRATING ".beargit/objects.new"
+
+/* A cache of the immutable files in commit directories (.index, .msg, .prev,
+ * .bitmap and small snapshots), so that commands walking history read each
+ * of them from disk once. Entries live in OBJECT_CACHE_SHARDS separately
+ * locked LRU lists holding up to OBJECT_CACHE_SIZE bytes between them; files
+ * larger than OBJECT_CACHE_MAX_OBJECT are read but not kept. An entry is
+ * only used while its file's inode, size and modification time match.
+ * object_read returns a malloc'ed, NUL-terminated copy (NULL if the file
+ * can't be read).
+ */
+#define OBJECT_CACHE_SHARDS 16
+#define OBJECT_CACHE_SIZE (32 << 20)
+#define OBJECT_CACHE_MAX_OBJECT (256 << 10)
+
+int is_object_path(const char* filename);
+char* object_read(const char* filename, size_t* size);
+void object_cache_clear(void);
+
+/* Bitmaps of commit positions, used for reachability queries. In memory a
+ * bitmap is a plain array of 64-bit words; on disk it is EWAH-compressed: each
+ * marker word describes a run of all-zero or all-one words followed by a
+ * number of literal words, which are stored right after the marker. Long
+ * histories are mostly runs of ones, so bitmaps stay a few words long.
+ */
+struct bitmap {
+  uint64_t* words;
+  size_t count;
+  size_t capacity;
+};
+
+void bitmap_init(struct bitmap* bitmap);
+void bitmap_free(struct bitmap* bitmap);
+void bitmap_copy(struct bitmap* dst, const struct bitmap* src);
+void bitmap_set(struct bitmap* bitmap, size_t bit);
+int bitmap_get(const struct bitmap* bitmap, size_t bit);
+size_t bitmap_count(const struct bitmap* bitmap);
+void bitmap_or(struct bitmap* dst, const struct bitmap* src);
+void bitmap_andnot(struct bitmap* dst, const struct bitmap* src);
+void bitmap_write(const char* filename, const struct bitmap* bitmap, uint32_t position);
+int bitmap_read(const char* filename, struct bitmap* bitmap, uint32_t* position);
+
+/* Ignore rules from a .beargitignore file, one glob per line:
+ *
+ *   #...      comment
+ *   !pat      re-include what an earlier pattern excluded
+ *   pat/      only match directories
+ *   a/pat     a pattern containing "/" matches the path from the top of the
+ *             tree, others match the last component at any depth
+ *
+ * "*" and "?" don't match "/", "**" does. The last matching pattern wins.
+ *
+ * Patterns without wildcards and "*.ext" patterns are looked up in hash
+ * sets, so only the remaining globs are tried one by one, and only those
+ * after the best match found so far.
+ */
+struct ignore_rule {
+  const char* pattern;
+  int negate;
+  int dir_only;
+  int anchored;
+};
+
+struct ignore_rules {
+  struct ignore_rule* rules;
+  int count;
+  struct strset* names;        // literal last components
+  struct strset* extensions;   // "*.<extension>"
+  struct strset* paths;        // literal paths from the top of the tree
+  int* globs;                  // indexes of all other rules, in order
+  int num_globs;
+  int globs_capacity;
+};
+
+void ignore_load(struct arena* arena, const char* filename, struct ignore_rules* rules);
+int ignore_match(const struct ignore_rules* rules, const char* path, int is_dir);
+
+/* Lists the files under <root> ("" for the whole working tree) that are
+ * neither in <tracked> nor ignored by <rules>, sorted, into <untracked>.
+ * Directories are read by up to WALK_MAX_THREADS threads sharing a queue,
+ * and ignored directories are never opened. .beargit is skipped.
+ */
+#define WALK_MAX_THREADS 8
+
+void walk_untracked(struct arena* arena, const char* root, const struct ignore_rules* rules,
+                    const struct strset* tracked, struct index* untracked);
+
+/**
+ * Lightweight tracing of where beargit spends its time.
+ *
+ * Tracing is off unless the BEARGIT_TRACE environment variable is set:
+ *
+ *   BEARGIT_TRACE=1 (or "summary")   print a table of spans and counters to
+ *                                    stderr when the command exits
+ *   BEARGIT_TRACE=chrome[:<file>]    write a Chrome trace-event JSON file
+ *                                    (default beargit-trace.json), which can be
+ *                                    loaded in chrome://tracing or Perfetto
+ *
+ * When tracing is off every macro below costs a single load and branch.
+ */
+enum trace_counter {
+  TRACE_FILES_COPIED,
+  TRACE_BYTES_MOVED,
+  TRACE_SYSCALLS,
+  TRACE_INDEX_ENTRIES,
+  TRACE_DIRS_CREATED,
+  TRACE_HASHES,
+  TRACE_CACHE_HITS,
+  TRACE_CACHE_MISSES,
+  TRACE_CACHE_EVICTIONS,
+  TRACE_NUM_COUNTERS
+};
+
+extern int trace_enabled;
+extern long long trace_counters[TRACE_NUM_COUNTERS];
+
+void trace_init(void);
+int trace_begin(const char* name);
+void trace_end(int span);
+
+// Opens a span called <name>, stored in the local variable <var>.
+#define TRACE_BEGIN(var, name) \
+  int var = trace_enabled ? trace_begin(name) : -1
+
+// Closes the span opened with TRACE_BEGIN(var, ...).
+#define TRACE_END(var) \
+  do { if (var >= 0) trace_end(var); } while (0)
+
+// Adds <n> to counter <c>.
+#define TRACE_COUNT(c, n) \
+  do { if (trace_enabled) __atomic_fetch_add(&trace_counters[c], (n), __ATOMIC_RELAXED); } while (0)
+
 #endif // _BEARGIT_UTIL_H_